@@ -0,0 +1,146 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "admission.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+
+#include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <time.h>
+
+/* how often the lateness of the main loop is sampled */
+#define LOOP_LAG_INTERVAL_MS	250
+
+const struct value_string admission_result_names[] = {
+	{ ADMISSION_OK,		"ok" },
+	{ ADMISSION_MAX_CALLS,	"max-calls" },
+	{ ADMISSION_MAX_SETUPS,	"max-setups" },
+	{ ADMISSION_LOOP_LAG,	"max-loop-lag" },
+	{ 0, NULL },
+};
+
+static const struct rate_ctr_desc admission_ctr_desc[_NUM_ADMISSION_RESULTS] = {
+	[ADMISSION_OK]		= { "admitted",		"Calls admitted" },
+	[ADMISSION_MAX_CALLS]	= { "rejected:calls",	"Calls rejected for the limit of concurrent calls" },
+	[ADMISSION_MAX_SETUPS]	= { "rejected:setups",	"Calls rejected for the limit of setups in progress" },
+	[ADMISSION_LOOP_LAG]	= { "rejected:lag",	"Calls rejected because the main loop lags behind" },
+};
+
+static const struct rate_ctr_group_desc admission_ctrg_desc = {
+	.group_name_prefix = "admission",
+	.group_description = "Admission control of new calls",
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+	.num_ctr = ARRAY_SIZE(admission_ctr_desc),
+	.ctr_desc = admission_ctr_desc,
+};
+
+static struct rate_ctr_group *admission_ctrs;
+
+static struct osmo_timer_list lag_timer;
+static struct timespec lag_due;
+static unsigned int loop_lag;
+
+static void lag_schedule(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &lag_due);
+	lag_due.tv_nsec += LOOP_LAG_INTERVAL_MS * 1000000;
+	if (lag_due.tv_nsec >= 1000000000) {
+		lag_due.tv_sec += 1;
+		lag_due.tv_nsec -= 1000000000;
+	}
+	osmo_timer_schedule(&lag_timer, 0, LOOP_LAG_INTERVAL_MS * 1000);
+}
+
+/* The timer fires late by about as much as the main loop is busy */
+static void lag_sample(void *data)
+{
+	struct timespec now;
+	long late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - lag_due.tv_sec) * 1000 + (now.tv_nsec - lag_due.tv_nsec) / 1000000;
+	if (late < 0)
+		late = 0;
+
+	/* smooth over a few samples so that a single slow iteration does not reject calls */
+	loop_lag = (loop_lag * 3 + late) / 4;
+	lag_schedule();
+}
+
+void admission_init(void *ctx)
+{
+	admission_ctrs = rate_ctr_group_alloc(ctx, &admission_ctrg_desc, 0);
+	osmo_timer_setup(&lag_timer, lag_sample, NULL);
+	admission_lag_update();
+}
+
+/* Sample the loop lag only while a limit needs it, an idle process stays asleep */
+void admission_lag_update(void)
+{
+	/* the config file is read before admission_init() */
+	if (!lag_timer.cb)
+		return;
+
+	if (!g_app.admission.max_loop_lag) {
+		osmo_timer_del(&lag_timer);
+		loop_lag = 0;
+	} else if (!osmo_timer_pending(&lag_timer))
+		lag_schedule();
+}
+
+static enum admission_result admission_limit(void)
+{
+	const struct admission_config *cfg = &g_app.admission;
+
+	if (cfg->max_calls && g_call_pools[CALL_POOL_CALL].in_use >= cfg->max_calls)
+		return ADMISSION_MAX_CALLS;
+	if (cfg->max_setups && g_calls_in_setup >= cfg->max_setups)
+		return ADMISSION_MAX_SETUPS;
+	if (cfg->max_loop_lag && loop_lag >= cfg->max_loop_lag)
+		return ADMISSION_LOOP_LAG;
+	return ADMISSION_OK;
+}
+
+/* May a new call be set up? Only cheap checks, no allocation. */
+enum admission_result admission_check(void)
+{
+	enum admission_result result = admission_limit();
+
+	if (admission_ctrs)
+		rate_ctr_inc2(admission_ctrs, result);
+	if (result != ADMISSION_OK)
+		LOGP(DAPP, LOGL_NOTICE, "Rejecting new call, %s reached\n",
+		     get_value_string(admission_result_names, result));
+	return result;
+}
+
+unsigned int admission_loop_lag(void)
+{
+	return loop_lag;
+}
+
+uint64_t admission_count(enum admission_result result)
+{
+	if (!admission_ctrs)
+		return 0;
+	return rate_ctr_group_get_ctr(admission_ctrs, result)->current;
+}
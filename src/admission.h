@@ -0,0 +1,36 @@
+#pragma once
+
+#include <osmocom/core/utils.h>
+
+#include <stdint.h>
+
+/*
+ * Admission control for new calls. A call is turned away before anything is
+ * allocated for it when one of the configured limits is reached, so that the
+ * calls already in progress keep their latency. A limit of 0 is no limit.
+ */
+enum admission_result {
+	ADMISSION_OK,
+	ADMISSION_MAX_CALLS,
+	ADMISSION_MAX_SETUPS,
+	ADMISSION_LOOP_LAG,
+	_NUM_ADMISSION_RESULTS
+};
+
+struct admission_config {
+	/* calls in total, calls not answered yet */
+	unsigned int max_calls;
+	unsigned int max_setups;
+	/* smoothed lateness of the main loop in milliseconds */
+	unsigned int max_loop_lag;
+	/* seconds for the Retry-After of the SIP 503 */
+	unsigned int retry_after;
+};
+
+void admission_init(void *ctx);
+void admission_lag_update(void);
+enum admission_result admission_check(void);
+unsigned int admission_loop_lag(void);
+uint64_t admission_count(enum admission_result result);
+
+extern const struct value_string admission_result_names[];
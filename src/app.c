@@ -24,6 +24,17 @@
 #include "mncc.h"
 #include "mncc_protocol.h"
 
+#include <talloc.h>
+
+#include <string.h>
+
+extern void *tall_mncc_ctx;
+
+static bool leg_on_conn(struct call_leg *leg, struct mncc_connection *conn)
+{
+	return leg && leg->type == CALL_TYPE_MNCC && ((struct mncc_call_leg *) leg)->conn == conn;
+}
+
 void app_mncc_disconnected(struct mncc_connection *conn)
 {
 	struct call *call, *tmp;
@@ -32,9 +43,10 @@ void app_mncc_disconnected(struct mncc_connection *conn)
 		struct call_leg *initial, *remote;
 		int has_mncc = 0;
 
-		if (call->initial && call->initial->type == CALL_TYPE_MNCC)
+		/* only calls through the MSC that went away */
+		if (leg_on_conn(call->initial, conn))
 			has_mncc = 1;
-		if (call->remote && call->remote->type == CALL_TYPE_MNCC)
+		if (leg_on_conn(call->remote, conn))
 			has_mncc = 1;
 
 		if (!has_mncc)
@@ -58,12 +70,161 @@ void app_mncc_disconnected(struct mncc_connection *conn)
 	}
 }
 
+struct mncc_connection *app_mncc_find(struct app_config *cfg, const char *path)
+{
+	struct mncc_connection *conn;
+
+	llist_for_each_entry(conn, &cfg->mncc.conns, entry) {
+		if (!strcmp(conn->path, path))
+			return conn;
+	}
+	return NULL;
+}
+
+/* Add the MNCC connection to an MSC. It still needs to be started. */
+struct mncc_connection *app_mncc_add(struct app_config *cfg, const char *path)
+{
+	struct mncc_connection *conn;
+
+	conn = app_mncc_find(cfg, path);
+	if (conn)
+		return conn;
+
+	conn = talloc_zero(tall_mncc_ctx, struct mncc_connection);
+	mncc_connection_init(conn, cfg);
+	conn->path = talloc_strdup(conn, path);
+	conn->on_disconnect = app_mncc_disconnected;
+	llist_add_tail(&conn->entry, &cfg->mncc.conns);
+	return conn;
+}
+
+int app_mncc_route_add(struct app_config *cfg, enum mncc_route_type type,
+			const char *first, const char *last, const char *path)
+{
+	struct mncc_connection *conn;
+	struct mncc_route *route;
+
+	conn = app_mncc_find(cfg, path);
+	if (!conn)
+		return -1;
+
+	route = talloc_zero(tall_mncc_ctx, struct mncc_route);
+	route->type = type;
+	route->first = talloc_strdup(route, first);
+	route->last = last ? talloc_strdup(route, last) : NULL;
+	route->conn = conn;
+	llist_add_tail(&route->entry, &cfg->mncc.routes);
+	return 0;
+}
+
+/* Remove the route with exactly these values, -1 if there is none */
+int app_mncc_route_del(struct app_config *cfg, enum mncc_route_type type,
+			const char *first, const char *last, const char *path)
+{
+	struct mncc_route *route;
+
+	llist_for_each_entry(route, &cfg->mncc.routes, entry) {
+		if (route->type != type || strcmp(route->first, first) || strcmp(route->conn->path, path))
+			continue;
+		if (last && strcmp(route->last, last))
+			continue;
+		llist_del(&route->entry);
+		talloc_free(route);
+		return 0;
+	}
+	return -1;
+}
+
+/* Remove the connection to an MSC with its routes and release its calls */
+void app_mncc_del(struct app_config *cfg, struct mncc_connection *conn)
+{
+	struct mncc_route *route, *tmp;
+
+	llist_for_each_entry_safe(route, tmp, &cfg->mncc.routes, entry) {
+		if (route->conn != conn)
+			continue;
+		llist_del(&route->entry);
+		talloc_free(route);
+	}
+
+	mncc_connection_stop(conn);
+	llist_del(&conn->entry);
+	talloc_free(conn);
+}
+
+static bool route_matches(const struct mncc_route *route, const char *dest)
+{
+	size_t len;
+
+	switch (route->type) {
+	case MNCC_ROUTE_PREFIX:
+		return !strncmp(dest, route->first, strlen(route->first));
+	case MNCC_ROUTE_IMSI:
+		len = strlen(route->first);
+		return strlen(dest) == len && strspn(dest, "0123456789") == len
+			&& strcmp(dest, route->first) >= 0 && strcmp(dest, route->last) <= 0;
+	}
+	return false;
+}
+
+/* The MSC for a call from SIP: the first matching route in configuration
+ * order, else the first MNCC connection. */
+struct mncc_connection *app_mncc_route(struct app_config *cfg, const char *dest)
+{
+	struct mncc_route *route;
+
+	llist_for_each_entry(route, &cfg->mncc.routes, entry) {
+		if (route_matches(route, dest))
+			return route->conn;
+	}
+
+	return llist_first_entry_or_null(&cfg->mncc.conns, struct mncc_connection, entry);
+}
+
+struct sip_trunk *app_sip_trunk_find(struct app_config *cfg, const char *addr, int port)
+{
+	struct sip_trunk *trunk;
+
+	llist_for_each_entry(trunk, &cfg->sip.trunks, entry) {
+		if (!strcmp(trunk->addr, addr) && trunk->port == port)
+			return trunk;
+	}
+	return NULL;
+}
+
+/* Add a SIP remote with weight 1 to send calls from the MSC to */
+struct sip_trunk *app_sip_trunk_add(struct app_config *cfg, const char *addr, int port)
+{
+	struct sip_trunk *trunk;
+
+	trunk = app_sip_trunk_find(cfg, addr, port);
+	if (trunk)
+		return trunk;
+
+	trunk = talloc_zero(tall_mncc_ctx, struct sip_trunk);
+	sip_trunk_init(trunk, &cfg->sip.agent);
+	trunk->addr = talloc_strdup(trunk, addr);
+	trunk->port = port;
+	llist_add_tail(&trunk->entry, &cfg->sip.trunks);
+	return trunk;
+}
+
 /*
  * I hook SIP and MNCC together.
  */
 void app_setup(struct app_config *cfg)
 {
-	cfg->mncc.conn.on_disconnect = app_mncc_disconnected;
+	struct mncc_connection *conn;
+
+	/* the default MSC and PBX, unless the config names its own */
+	if (llist_empty(&cfg->mncc.conns))
+		app_mncc_add(cfg, "/tmp/msc_mncc");
+	if (llist_empty(&cfg->sip.trunks))
+		app_sip_trunk_add(cfg, "pbx", 5060);
+
+	llist_for_each_entry(conn, &cfg->mncc.conns, entry)
+		mncc_connection_start(conn);
+	sip_agent_options_start(&cfg->sip.agent);
 }
 
 static void route_to_sip(struct call *call)
@@ -74,7 +235,18 @@ static void route_to_sip(struct call *call)
 
 static void route_to_mncc(struct call *call)
 {
-	if (mncc_create_remote_leg(&g_app.mncc.conn, call) != 0)
+	struct mncc_connection *conn = app_mncc_route(&g_app, call->dest);
+
+	if (!conn) {
+		LOGP(DAPP, LOGL_ERROR, "call(%u) no MNCC connection for dest(%s)\n",
+			call->id, call->dest);
+		call->initial->release_call(call->initial);
+		return;
+	}
+
+	LOGP(DAPP, LOGL_DEBUG, "call(%u) routing dest(%s) to MNCC %s\n",
+		call->id, call->dest, conn->path);
+	if (mncc_create_remote_leg(conn, call) != 0)
 		call->initial->release_call(call->initial);
 }
 
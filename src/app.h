@@ -1,27 +1,61 @@
 #pragma once
 
+#include "admission.h"
 #include "mncc.h"
 #include "sip.h"
 
 struct call;
 
+enum mncc_route_type {
+	MNCC_ROUTE_PREFIX,
+	MNCC_ROUTE_IMSI,
+};
+
+/* Selects the MSC for a call from SIP by its called number or IMSI */
+struct mncc_route {
+	struct llist_head entry;
+	enum mncc_route_type type;
+	/* the number prefix, or the first and last IMSI of the range */
+	const char *first;
+	const char *last;
+	struct mncc_connection *conn;
+};
+
 struct app_config {
 	struct {
 		const char *local_addr;
 		int local_port;
+		/* the port bound in a worker, which differs from local_port; 0 otherwise */
+		int worker_port;
 		int sofia_log_level;
+		/* run the nua stack in a thread of its own */
+		bool stack_thread;
 
-		const char *remote_addr;
-		int remote_port;
 		struct sip_agent agent;
+		/* struct sip_trunk, the remotes calls from the MSC are balanced over */
+		struct llist_head trunks;
+		enum sip_trunk_selection trunk_selection;
+		/* seconds between the OPTIONS to each remote, 0 for none */
+		unsigned int options_interval;
+		struct breaker_config breaker;
 	} sip;
 
 	struct {
-		const char *path;
-		struct mncc_connection conn;
+		/* one struct mncc_connection per MSC, the first one takes unrouted calls */
+		struct llist_head conns;
+		/* struct mncc_route, in configuration order */
+		struct llist_head routes;
+		/* max. number of messages read per wakeup */
+		int read_budget;
+		/* seconds to wait for the answer to an MNCC command */
+		int cmd_timeout;
 	} mncc;
 
+	struct admission_config admission;
+
 	int use_imsi_as_id;
+	/* idle calls/legs kept for re-use in each pool */
+	unsigned int call_pool_high_water;
 };
 
 extern struct app_config g_app;
@@ -30,5 +64,16 @@ void app_setup(struct app_config *cfg);
 void app_route_call(struct call *call, const char *source, const char *port);
 
 void app_mncc_disconnected(struct mncc_connection *conn);
+struct mncc_connection *app_mncc_find(struct app_config *cfg, const char *path);
+struct mncc_connection *app_mncc_add(struct app_config *cfg, const char *path);
+int app_mncc_route_add(struct app_config *cfg, enum mncc_route_type type,
+			const char *first, const char *last, const char *path);
+int app_mncc_route_del(struct app_config *cfg, enum mncc_route_type type,
+			const char *first, const char *last, const char *path);
+void app_mncc_del(struct app_config *cfg, struct mncc_connection *conn);
+struct mncc_connection *app_mncc_route(struct app_config *cfg, const char *dest);
+
+struct sip_trunk *app_sip_trunk_find(struct app_config *cfg, const char *addr, int port);
+struct sip_trunk *app_sip_trunk_add(struct app_config *cfg, const char *addr, int port);
 
 const char *app_media_name(int pt_msg);
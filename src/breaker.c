@@ -0,0 +1,180 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "breaker.h"
+#include "logging.h"
+
+#include <osmocom/core/logging.h>
+
+/* never stay open longer than this, whatever the Retry-After says */
+#define BREAKER_MAX_OPEN_TIME	3600
+
+const struct value_string breaker_state_names[] = {
+	{ BREAKER_CLOSED,	"closed" },
+	{ BREAKER_OPEN,		"open" },
+	{ BREAKER_HALF_OPEN,	"half-open" },
+	{ 0, NULL },
+};
+
+static bool is_failure(int status)
+{
+	/* 408 is what sofia-sip reports when the INVITE transaction timed out */
+	return status == 408 || (status >= 500 && status < 600);
+}
+
+static bool time_reached(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+static void set_until(struct circuit_breaker *breaker, unsigned int seconds)
+{
+	clock_gettime(CLOCK_MONOTONIC, &breaker->until);
+	breaker->until.tv_sec += seconds;
+}
+
+static void reset_outcomes(struct circuit_breaker *breaker)
+{
+	breaker->outcomes = 0;
+	breaker->num_outcomes = 0;
+}
+
+static void breaker_open(struct circuit_breaker *breaker, int status, unsigned int seconds)
+{
+	if (seconds > BREAKER_MAX_OPEN_TIME)
+		seconds = BREAKER_MAX_OPEN_TIME;
+
+	LOGP(DSIP, LOGL_NOTICE, "Circuit breaker opens for %us after status(%d), %u of %u INVITEs failed\n",
+	     seconds, status, breaker_failures(breaker), breaker->num_outcomes);
+	breaker->state = BREAKER_OPEN;
+	breaker->open_status = status;
+	breaker->opened += 1;
+	set_until(breaker, seconds);
+	reset_outcomes(breaker);
+}
+
+void breaker_init(struct circuit_breaker *breaker, const struct breaker_config *cfg)
+{
+	*breaker = (struct circuit_breaker) { .cfg = cfg, .state = BREAKER_CLOSED };
+}
+
+unsigned int breaker_failures(const struct circuit_breaker *breaker)
+{
+	return __builtin_popcountll(breaker->outcomes);
+}
+
+/* Would breaker_allow() let a call through? Changes nothing. */
+bool breaker_available(const struct circuit_breaker *breaker)
+{
+	const struct breaker_config *cfg = breaker->cfg;
+
+	if (!cfg->failure_percent)
+		return true;
+
+	switch (breaker->state) {
+	case BREAKER_CLOSED:
+		return true;
+	case BREAKER_OPEN:
+		return time_reached(&breaker->until);
+	case BREAKER_HALF_OPEN:
+		return breaker->probes_sent < cfg->probes || time_reached(&breaker->until);
+	}
+	return false;
+}
+
+/* May a new call be sent to the trunk? Counts it as a probe when half-open. */
+bool breaker_allow(struct circuit_breaker *breaker)
+{
+	const struct breaker_config *cfg = breaker->cfg;
+
+	if (!cfg->failure_percent)
+		return true;
+
+	switch (breaker->state) {
+	case BREAKER_CLOSED:
+		return true;
+	case BREAKER_OPEN:
+		if (!time_reached(&breaker->until))
+			break;
+		LOGP(DSIP, LOGL_NOTICE, "Circuit breaker half-open, probing with %u calls\n", cfg->probes);
+		breaker->state = BREAKER_HALF_OPEN;
+		breaker->probes_sent = 0;
+		breaker->probes_ok = 0;
+		set_until(breaker, cfg->open_time);
+		/* fall through */
+	case BREAKER_HALF_OPEN:
+		if (breaker->probes_sent >= cfg->probes) {
+			/* a probe released before its answer never reports back, send new ones after a while */
+			if (!time_reached(&breaker->until))
+				break;
+			breaker->probes_sent = breaker->probes_ok;
+			set_until(breaker, cfg->open_time);
+		}
+		breaker->probes_sent += 1;
+		return true;
+	}
+
+	breaker->rejected += 1;
+	return false;
+}
+
+/*
+ * Final response to an INVITE sent to the trunk. retry_after is the value of
+ * the Retry-After header in seconds, or 0.
+ */
+void breaker_result(struct circuit_breaker *breaker, int status, unsigned int retry_after)
+{
+	const struct breaker_config *cfg = breaker->cfg;
+	bool failed = is_failure(status);
+
+	if (!cfg->failure_percent)
+		return;
+
+	switch (breaker->state) {
+	case BREAKER_CLOSED:
+		breaker->outcomes = (breaker->outcomes << 1) | failed;
+		breaker->num_outcomes = OSMO_MIN(breaker->num_outcomes + 1, cfg->window);
+		if (cfg->window < BREAKER_MAX_WINDOW)
+			breaker->outcomes &= (1ULL << cfg->window) - 1;
+
+		if (failed && retry_after)
+			breaker_open(breaker, status, retry_after);
+		else if (failed && breaker->num_outcomes == cfg->window
+			 && breaker_failures(breaker) * 100 >= cfg->failure_percent * cfg->window)
+			breaker_open(breaker, status, cfg->open_time);
+		break;
+	case BREAKER_HALF_OPEN:
+		if (failed) {
+			breaker_open(breaker, status, retry_after ? retry_after : cfg->open_time);
+			break;
+		}
+		breaker->probes_ok += 1;
+		if (breaker->probes_ok < cfg->probes)
+			break;
+		LOGP(DSIP, LOGL_NOTICE, "Circuit breaker closes, %u probes succeeded\n", breaker->probes_ok);
+		breaker->state = BREAKER_CLOSED;
+		reset_outcomes(breaker);
+		break;
+	case BREAKER_OPEN:
+		/* answers to calls sent before the breaker opened */
+		break;
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <osmocom/core/utils.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Circuit breaker of a SIP trunk. The outcome of the last INVITEs is kept;
+ * when too many of them failed (5xx or a transaction timeout), or the trunk
+ * asked for a pause with Retry-After, the breaker opens and new calls are
+ * rejected without trying the trunk. After the open time a few calls are let
+ * through as probes and the breaker closes when they all succeed.
+ */
+enum breaker_state {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN,
+};
+
+/* the outcomes of at most this many INVITEs are considered */
+#define BREAKER_MAX_WINDOW	64
+
+struct breaker_config {
+	/* open at this share of failed INVITEs, 0 disables the breaker */
+	unsigned int failure_percent;
+	/* number of recent INVITEs considered */
+	unsigned int window;
+	/* seconds to stay open, unless the trunk sent a Retry-After */
+	unsigned int open_time;
+	/* calls let through while half-open */
+	unsigned int probes;
+};
+
+struct circuit_breaker {
+	const struct breaker_config *cfg;
+	enum breaker_state state;
+
+	/* one bit per INVITE, set for a failure, newest in bit 0 */
+	uint64_t outcomes;
+	unsigned int num_outcomes;
+
+	/* until when the breaker is open, or since when the probes are out */
+	struct timespec until;
+	unsigned int probes_sent;
+	unsigned int probes_ok;
+	/* SIP status of the failure that opened the breaker */
+	int open_status;
+
+	unsigned long long opened;
+	unsigned long long rejected;
+};
+
+void breaker_init(struct circuit_breaker *breaker, const struct breaker_config *cfg);
+bool breaker_available(const struct circuit_breaker *breaker);
+bool breaker_allow(struct circuit_breaker *breaker);
+void breaker_result(struct circuit_breaker *breaker, int status, unsigned int retry_after);
+unsigned int breaker_failures(const struct circuit_breaker *breaker);
+
+extern const struct value_string breaker_state_names[];
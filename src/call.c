@@ -19,14 +19,49 @@
  */
 
 #include "call.h"
+#include "latency.h"
 #include "logging.h"
+#include "app.h"
 
 #include <talloc.h>
 
 extern void *tall_mncc_ctx;
 
 LLIST_HEAD(g_call_list);
+unsigned int g_calls_in_setup;
 static uint32_t last_call_id = 5000;
+static uint32_t call_id_step = 1;
+
+/* ids of each worker incarnation, see calls_set_id_space() */
+#define CALL_ID_SPAN		(1 << 20)
+/* callrefs from 0x80000000 on are chosen by the MSC for calls from the MS */
+#define CALL_ID_MSC_RANGE	0x80000000
+
+/* MNCC legs indexed by callref, so MNCC dispatch does not walk g_call_list */
+static DECLARE_HASHTABLE(mncc_legs_by_callref, 10);
+/* SIP legs indexed by their nua_handle */
+static DECLARE_HASHTABLE(sip_legs_by_handle, 10);
+
+/*
+ * Calls and call legs are recycled through these pools instead of going
+ * back to malloc on every call. Up to g_app.call_pool_high_water idle
+ * objects are kept per pool.
+ */
+struct call_pool g_call_pools[_NUM_CALL_POOLS] = {
+	[CALL_POOL_CALL] = {
+		.name = "call",
+		.size = sizeof(struct call),
+	},
+	[CALL_POOL_SIP_LEG] = {
+		.name = "sip_call_leg",
+		.size = sizeof(struct sip_call_leg),
+	},
+	[CALL_POOL_MNCC_LEG] = {
+		.name = "mncc_call_leg",
+		.size = sizeof(struct mncc_call_leg),
+	},
+};
+static void *pool_ctx;
 
 
 const struct value_string call_type_vals[] = {
@@ -64,8 +99,277 @@ const struct value_string sip_dir_vals[] = {
 	{ 0, NULL },
 };
 
+static void *call_pool_alloc(struct call_pool *pool, const void *ctx)
+{
+	void *obj;
+
+	if (pool->free_list) {
+		obj = pool->free_list;
+		pool->free_list = *(void **) obj;
+		pool->idle -= 1;
+		pool->hits += 1;
+		talloc_steal(ctx, obj);
+		memset(obj, 0, pool->size);
+	} else {
+		obj = talloc_zero_size(ctx, pool->size);
+		if (!obj)
+			return NULL;
+		talloc_set_name_const(obj, pool->name);
+		pool->misses += 1;
+	}
+
+	pool->in_use += 1;
+	if (pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+	return obj;
+}
+
+static void call_pool_put(struct call_pool *pool, void *obj)
+{
+	if (pool->idle >= g_app.call_pool_high_water) {
+		talloc_free(obj);
+		return;
+	}
+
+	talloc_free_children(obj);
+	talloc_steal(pool_ctx, obj);
+	*(void **) obj = pool->free_list;
+	pool->free_list = obj;
+	pool->idle += 1;
+}
+
+static void call_pool_free(struct call_pool *pool, void *obj)
+{
+	pool->in_use -= 1;
+	call_pool_put(pool, obj);
+}
+
+/* Fill or trim the idle objects of all pools to the high-water mark */
+void call_pools_resize(void)
+{
+	int i;
+
+	/* not yet initialized, calls_init() will fill the pools */
+	if (!pool_ctx)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(g_call_pools); ++i) {
+		struct call_pool *pool = &g_call_pools[i];
+
+		while (pool->idle > g_app.call_pool_high_water) {
+			void *obj = pool->free_list;
+			pool->free_list = *(void **) obj;
+			pool->idle -= 1;
+			talloc_free(obj);
+		}
+
+		while (pool->idle < g_app.call_pool_high_water) {
+			void *obj = talloc_zero_size(pool_ctx, pool->size);
+			if (!obj) {
+				LOGP(DCALL, LOGL_ERROR, "Failed to preallocate %s\n", pool->name);
+				break;
+			}
+			talloc_set_name_const(obj, pool->name);
+			call_pool_put(pool, obj);
+		}
+	}
+}
+
+static const struct rate_ctr_desc call_ctr_desc[] = {
+	[CALL_CTR_MO_ATTEMPT] =			{ "mo:attempt", "MO call attempts (MNCC_SETUP_IND)" },
+	[CALL_CTR_MO_CONNECT] =			{ "mo:connect", "MO calls answered by the SIP side" },
+	[CALL_CTR_MT_ATTEMPT] =			{ "mt:attempt", "MT call attempts (SIP INVITE)" },
+	[CALL_CTR_MT_CONNECT] =			{ "mt:connect", "MT calls answered by the MS" },
+	[CALL_CTR_REJECTED] =			{ "rejected", "Calls released before they were answered" },
+	[CALL_CTR_REJECTED_UNASSIGNED_NR] =	{ "rejected:unassigned_nr", "Rejected: unassigned number" },
+	[CALL_CTR_REJECTED_NO_ROUTE] =		{ "rejected:no_route", "Rejected: no route to destination" },
+	[CALL_CTR_REJECTED_CHAN_UNACCEPT] =	{ "rejected:chan_unaccept", "Rejected: channel unacceptable" },
+	[CALL_CTR_REJECTED_NORM_CALL_CLEAR] =	{ "rejected:norm_call_clear", "Rejected: normal call clearing" },
+	[CALL_CTR_REJECTED_USER_BUSY] =		{ "rejected:user_busy", "Rejected: user busy" },
+	[CALL_CTR_REJECTED_USER_NOTRESPOND] =	{ "rejected:user_notrespond", "Rejected: no user responding" },
+	[CALL_CTR_REJECTED_USER_ALERTING_NA] =	{ "rejected:user_alerting_na", "Rejected: no answer" },
+	[CALL_CTR_REJECTED_CALL_REJECTED] =	{ "rejected:call_rejected", "Rejected: call rejected" },
+	[CALL_CTR_REJECTED_NORMAL_UNSPEC] =	{ "rejected:normal_unspec", "Rejected: normal, unspecified" },
+	[CALL_CTR_REJECTED_TEMP_FAILURE] =	{ "rejected:temp_failure", "Rejected: temporary failure" },
+	[CALL_CTR_REJECTED_SWITCH_CONG] =	{ "rejected:switch_cong", "Rejected: switching equipment congestion" },
+	[CALL_CTR_REJECTED_RESOURCE_UNAVAIL] =	{ "rejected:resource_unavail", "Rejected: resource unavailable" },
+	[CALL_CTR_REJECTED_OTHER] =		{ "rejected:other", "Rejected: any other cause" },
+	[CALL_CTR_SIP_INVITE_2XX] =		{ "sip:invite:2xx", "2xx final responses to our INVITEs" },
+	[CALL_CTR_SIP_INVITE_3XX] =		{ "sip:invite:3xx", "3xx final responses to our INVITEs" },
+	[CALL_CTR_SIP_INVITE_4XX] =		{ "sip:invite:4xx", "4xx final responses to our INVITEs" },
+	[CALL_CTR_SIP_INVITE_5XX] =		{ "sip:invite:5xx", "5xx final responses to our INVITEs" },
+	[CALL_CTR_SIP_INVITE_6XX] =		{ "sip:invite:6xx", "6xx final responses to our INVITEs" },
+	[CALL_CTR_HOLD] =			{ "hold", "Calls put on hold by the MS" },
+	[CALL_CTR_RETRIEVE] =			{ "retrieve", "Calls retrieved by the MS" },
+	[CALL_CTR_DTMF] =			{ "dtmf", "DTMF tones started by the MS" },
+};
+
+static const struct rate_ctr_group_desc call_ctrg_desc = {
+	.group_name_prefix = "call",
+	.group_description = "Call lifecycle",
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+	.num_ctr = ARRAY_SIZE(call_ctr_desc),
+	.ctr_desc = call_ctr_desc,
+};
+
+struct rate_ctr_group *g_call_ctrs;
+
+/* Count a call that ended before it was answered, by its GSM 04.08 cause */
+void call_ctr_rejected(int cause)
+{
+	enum call_ctr ctr;
+
+	switch (cause) {
+	case GSM48_CC_CAUSE_UNASSIGNED_NR:
+		ctr = CALL_CTR_REJECTED_UNASSIGNED_NR;
+		break;
+	case GSM48_CC_CAUSE_NO_ROUTE:
+		ctr = CALL_CTR_REJECTED_NO_ROUTE;
+		break;
+	case GSM48_CC_CAUSE_CHAN_UNACCEPT:
+		ctr = CALL_CTR_REJECTED_CHAN_UNACCEPT;
+		break;
+	case GSM48_CC_CAUSE_NORM_CALL_CLEAR:
+		ctr = CALL_CTR_REJECTED_NORM_CALL_CLEAR;
+		break;
+	case GSM48_CC_CAUSE_USER_BUSY:
+		ctr = CALL_CTR_REJECTED_USER_BUSY;
+		break;
+	case GSM48_CC_CAUSE_USER_NOTRESPOND:
+		ctr = CALL_CTR_REJECTED_USER_NOTRESPOND;
+		break;
+	case GSM48_CC_CAUSE_USER_ALERTING_NA:
+		ctr = CALL_CTR_REJECTED_USER_ALERTING_NA;
+		break;
+	case GSM48_CC_CAUSE_CALL_REJECTED:
+		ctr = CALL_CTR_REJECTED_CALL_REJECTED;
+		break;
+	case GSM48_CC_CAUSE_NORMAL_UNSPEC:
+		ctr = CALL_CTR_REJECTED_NORMAL_UNSPEC;
+		break;
+	case GSM48_CC_CAUSE_TEMP_FAILURE:
+		ctr = CALL_CTR_REJECTED_TEMP_FAILURE;
+		break;
+	case GSM48_CC_CAUSE_SWITCH_CONG:
+		ctr = CALL_CTR_REJECTED_SWITCH_CONG;
+		break;
+	case GSM48_CC_CAUSE_RESOURCE_UNAVAIL:
+		ctr = CALL_CTR_REJECTED_RESOURCE_UNAVAIL;
+		break;
+	default:
+		ctr = CALL_CTR_REJECTED_OTHER;
+		break;
+	}
+
+	call_ctr_inc(CALL_CTR_REJECTED);
+	call_ctr_inc(ctr);
+}
+
+/* Count a final response to an INVITE we sent, by status class */
+void call_ctr_sip_final(int status)
+{
+	if (status < 200 || status >= 700)
+		return;
+	call_ctr_inc(CALL_CTR_SIP_INVITE_2XX + status / 100 - 2);
+}
+
+const struct value_string call_setup_ts_names[] = {
+	{ CALL_TS_SETUP,	"setup" },
+	{ CALL_TS_RTP_CREATE,	"rtp-create" },
+	{ CALL_TS_INVITE,	"invite" },
+	{ CALL_TS_RINGING,	"ringing" },
+	{ CALL_TS_ANSWER,	"answer" },
+	{ CALL_TS_CONNECTED,	"connected" },
+	{ 0, NULL },
+};
+
+bool call_stamped(const struct call *call, enum call_setup_ts ts)
+{
+	return call->setup_ts[ts].tv_sec || call->setup_ts[ts].tv_nsec;
+}
+
+/* Remember when the call reached a setup transition. Only the first time counts. */
+void call_stamp(struct call *call, enum call_setup_ts ts)
+{
+	struct timespec *stamp = &call->setup_ts[ts];
+
+	if (call_stamped(call, ts))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, stamp);
+
+	switch (ts) {
+	case CALL_TS_RINGING:
+		setup_delay_record(SETUP_DELAY_PDD, &call->setup_ts[CALL_TS_SETUP], stamp);
+		break;
+	case CALL_TS_ANSWER:
+		if (call_stamped(call, CALL_TS_RINGING))
+			setup_delay_record(SETUP_DELAY_ANSWER, &call->setup_ts[CALL_TS_RINGING], stamp);
+		else
+			setup_delay_record(SETUP_DELAY_PDD, &call->setup_ts[CALL_TS_SETUP], stamp);
+		break;
+	default:
+		break;
+	}
+}
+
 void calls_init(void)
-{}
+{
+	hash_init(mncc_legs_by_callref);
+	hash_init(sip_legs_by_handle);
+	g_call_ctrs = rate_ctr_group_alloc(tall_mncc_ctx, &call_ctrg_desc, 0);
+
+	pool_ctx = talloc_named_const(tall_mncc_ctx, 0, "call pools");
+	call_pools_resize();
+}
+
+static struct call_pool *call_leg_pool(struct call_leg *leg)
+{
+	switch (leg->type) {
+	case CALL_TYPE_SIP:
+		return &g_call_pools[CALL_POOL_SIP_LEG];
+	case CALL_TYPE_MNCC:
+		return &g_call_pools[CALL_POOL_MNCC_LEG];
+	default:
+		return NULL;
+	}
+}
+
+static void *call_leg_alloc(struct call *call, int type)
+{
+	struct call_leg *leg;
+	struct call_pool *pool;
+
+	pool = type == CALL_TYPE_SIP ? &g_call_pools[CALL_POOL_SIP_LEG] : &g_call_pools[CALL_POOL_MNCC_LEG];
+	leg = call_pool_alloc(pool, call);
+	if (!leg)
+		return NULL;
+
+	leg->type = type;
+	leg->call = call;
+	return leg;
+}
+
+struct sip_call_leg *call_sip_leg_alloc(struct call *call)
+{
+	return call_leg_alloc(call, CALL_TYPE_SIP);
+}
+
+struct mncc_call_leg *call_mncc_leg_alloc(struct call *call)
+{
+	return call_leg_alloc(call, CALL_TYPE_MNCC);
+}
+
+/* Give back a leg that is not (or no longer) part of its call */
+void call_leg_free(struct call_leg *leg)
+{
+	struct call_pool *pool = call_leg_pool(leg);
+
+	if (!pool) {
+		talloc_free(leg);
+		return;
+	}
+	call_pool_free(pool, leg);
+}
 
 void call_leg_release(struct call_leg *leg)
 {
@@ -82,36 +386,94 @@ void call_leg_release(struct call_leg *leg)
 		return;
 	}
 
-	talloc_free(leg);
+	if (leg->type == CALL_TYPE_MNCC)
+		hash_del(&((struct mncc_call_leg *) leg)->callref_entry);
+	else if (leg->type == CALL_TYPE_SIP) {
+		struct sip_call_leg *sip = (struct sip_call_leg *) leg;
+
+		hash_del(&sip->nua_handle_entry);
+		if (sip->trunk)
+			sip->trunk->active_calls -= 1;
+	}
+
+	if (!call->cause)
+		call->cause = leg->cause;
+
+	call_leg_free(leg);
 	if (!call->initial && !call->remote) {
 		uint32_t id = call->id;
+
+		if (!call->connected) {
+			call_ctr_rejected(call->cause);
+			g_calls_in_setup -= 1;
+		}
 		llist_del(&call->entry);
-		talloc_free(call);
+		call_pool_free(&g_call_pools[CALL_POOL_CALL], call);
 		LOGP(DAPP, LOGL_DEBUG, "call(%u) released.\n", id);
 	}
 }
 
-struct call *call_mncc_create(void)
+/*
+ * Give the calls of worker index out of count workers ids of their own. The
+ * id is also the callref of calls to the MS, which have to be unique per MSC.
+ * A restarted worker starts CALL_ID_SPAN ids per worker after the one before
+ * it, the MSC might still have calls of the dead one. The ids stay below the
+ * callrefs of the MSC, so this only holds for the last
+ * (CALL_ID_MSC_RANGE - 5000) / (count * CALL_ID_SPAN) incarnations, 2047 for
+ * one worker and 31 for 64. Older ones are long gone by then.
+ */
+void calls_set_id_space(unsigned int index, unsigned int count, unsigned int incarnation)
+{
+	uint32_t slots = (CALL_ID_MSC_RANGE - 5000) / ((uint32_t) count * CALL_ID_SPAN);
+
+	last_call_id = 5000 + index + (incarnation % slots) * count * CALL_ID_SPAN;
+	call_id_step = count;
+}
+
+static uint32_t next_call_id(void)
+{
+	last_call_id += call_id_step;
+	/* start over below the callrefs of the MSC */
+	if (last_call_id >= CALL_ID_MSC_RANGE)
+		last_call_id = 5000 + (last_call_id - 5000) % call_id_step;
+	return last_call_id;
+}
+
+/* The call was answered on both sides, it no longer counts as a setup in progress */
+void call_connected(struct call *call)
+{
+	if (call->connected)
+		return;
+	call->connected = true;
+	g_calls_in_setup -= 1;
+}
+
+struct call *call_mncc_create(struct mncc_connection *conn, uint32_t callref)
 {
 	struct call *call;
+	struct mncc_call_leg *leg;
 
-	call = talloc_zero(tall_mncc_ctx, struct call);
+	call = call_pool_alloc(&g_call_pools[CALL_POOL_CALL], tall_mncc_ctx);
 	if (!call) {
 		LOGP(DCALL, LOGL_ERROR, "Failed to allocate memory for call\n");
 		return NULL;
 	}
-	call->id = ++last_call_id;
+	call->id = next_call_id();
+	call_stamp(call, CALL_TS_SETUP);
 
-	call->initial = (struct call_leg *) talloc_zero(call, struct mncc_call_leg);
-	if (!call->initial) {
+	leg = call_mncc_leg_alloc(call);
+	if (!leg) {
 		LOGP(DCALL, LOGL_ERROR, "Failed to allocate MNCC leg\n");
-		talloc_free(call);
+		call_pool_free(&g_call_pools[CALL_POOL_CALL], call);
 		return NULL;
 	}
 
-	call->initial->type = CALL_TYPE_MNCC;
-	call->initial->call = call;
+	call->initial = &leg->base;
+	leg->conn = conn;
+	leg->callref = callref;
+	call_mncc_leg_add(leg);
 	llist_add(&call->entry, &g_call_list);
+	g_calls_in_setup += 1;
 	return call;
 }
 
@@ -119,26 +481,64 @@ struct call *call_sip_create(void)
 {
 	struct call *call;
 
-	call = talloc_zero(tall_mncc_ctx, struct call);
+	call = call_pool_alloc(&g_call_pools[CALL_POOL_CALL], tall_mncc_ctx);
 	if (!call) {
 		LOGP(DCALL, LOGL_ERROR, "Failed to allocate memory for call\n");
 		return NULL;
 	}
-	call->id = ++last_call_id;
+	call->id = next_call_id();
+	call_stamp(call, CALL_TS_SETUP);
 
-	call->initial = (struct call_leg *) talloc_zero(call, struct sip_call_leg);
+	call->initial = (struct call_leg *) call_sip_leg_alloc(call);
 	if (!call->initial) {
 		LOGP(DCALL, LOGL_ERROR, "Failed to allocate SIP leg\n");
-		talloc_free(call);
+		call_pool_free(&g_call_pools[CALL_POOL_CALL], call);
 		return NULL;
 	}
 
-	call->initial->type = CALL_TYPE_SIP;
-	call->initial->call = call;
 	llist_add(&call->entry, &g_call_list);
+	g_calls_in_setup += 1;
 	return call;
 }
 
+/* Make an MNCC leg findable by its callref. It is removed in call_leg_release() */
+void call_mncc_leg_add(struct mncc_call_leg *leg)
+{
+	hash_add(mncc_legs_by_callref, &leg->callref_entry, leg->callref);
+}
+
+/* Find a MNCC Call leg (whether MO or MT) of the given MSC connection by callref */
+struct mncc_call_leg *call_mncc_leg_find(const struct mncc_connection *conn, uint32_t callref)
+{
+	struct mncc_call_leg *leg;
+
+	hash_for_each_possible(mncc_legs_by_callref, leg, callref_entry, callref) {
+		if (leg->callref == callref && leg->conn == conn)
+			return leg;
+	}
+
+	return NULL;
+}
+
+/* Make a SIP leg findable by its nua_handle. It is removed in call_leg_release() */
+void call_sip_leg_add(struct sip_call_leg *leg)
+{
+	hash_add(sip_legs_by_handle, &leg->nua_handle_entry, (uintptr_t) leg->nua_handle);
+}
+
+/* Find a SIP Call leg by given nua_handle */
+struct sip_call_leg *call_sip_leg_find(const struct nua_handle_s *nh)
+{
+	struct sip_call_leg *leg;
+
+	hash_for_each_possible(sip_legs_by_handle, leg, nua_handle_entry, (uintptr_t) nh) {
+		if (leg->nua_handle == nh)
+			return leg;
+	}
+
+	return NULL;
+}
+
 struct call_leg *call_leg_other(struct call_leg *leg)
 {
 	if (leg->call->initial == leg)
@@ -173,19 +573,56 @@ const char *call_leg_state(struct call_leg *leg)
 	}
 }
 
+void call_leg_flush_sdp_cache(struct call_leg *leg)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(leg->sdp_cache); ++i) {
+		talloc_unlink(leg, leg->sdp_cache[i]);
+		leg->sdp_cache[i] = NULL;
+	}
+}
+
+/* FNV-1a hash of a nul terminated string, computed in the same pass as its length */
+static uint32_t sdp_hash(const char *sdp, size_t *len)
+{
+	const char *pos;
+	uint32_t hash = 2166136261u;
+
+	for (pos = sdp; *pos; ++pos) {
+		hash ^= (uint8_t) *pos;
+		hash *= 16777619u;
+	}
+	*len = pos - sdp;
+	return hash;
+}
+
 void call_leg_rx_sdp(struct call_leg *leg, const char *rx_sdp)
 {
-	/* If no SDP was received, keep whatever SDP was previously seen. */
-	if (!rx_sdp || !*rx_sdp || !strncmp(leg->rx_sdp, rx_sdp, sizeof(leg->rx_sdp))) {
-		LOGP(DAPP, LOGL_DEBUG, "call(%u) leg(0x%p) no new SDP in %s\n", leg->call->id, leg,
-		     osmo_quote_str(rx_sdp, -1));
-		LOGP(DAPP, LOGL_DEBUG, "call(%u) leg(0x%p) keep stored SDP=%s\n", leg->call->id, leg,
-		     osmo_quote_str(leg->rx_sdp, -1));
+	size_t len = 0;
+	uint32_t hash = 0;
+
+	if (rx_sdp)
+		hash = sdp_hash(rx_sdp, &len);
+
+	/* If no SDP was received, keep whatever SDP was previously seen. Only when length and hash match, the stored
+	 * SDP needs to be looked at to rule out a collision. */
+	if (!len || (leg->rx_sdp && len == leg->rx_sdp_len && hash == leg->rx_sdp_hash
+		     && !memcmp(leg->rx_sdp, rx_sdp, len))) {
+		LOGP_HOT(DAPP, "call(%u) leg(0x%p) no new SDP in %s\n", leg->call->id, leg,
+			 osmo_quote_str(rx_sdp, -1));
+		LOGP_HOT(DAPP, "call(%u) leg(0x%p) keep stored SDP=%s\n", leg->call->id, leg,
+			 osmo_quote_str(leg->rx_sdp, -1));
 		return;
 	}
-	LOGP(DAPP, LOGL_DEBUG, "call(%u) leg(0x%p) received new SDP=%s\n", leg->call->id, leg, osmo_quote_str(rx_sdp, -1));
-	LOGP(DAPP, LOGL_DEBUG, "call(%u) leg(0x%p) replaced old SDP=%s\n", leg->call->id, leg,
-	     osmo_quote_str(leg->rx_sdp, -1));
-	OSMO_STRLCPY_ARRAY(leg->rx_sdp, rx_sdp);
+	LOGP_HOT(DAPP, "call(%u) leg(0x%p) received new SDP=%s\n", leg->call->id, leg,
+		 osmo_quote_str(rx_sdp, -1));
+	LOGP_HOT(DAPP, "call(%u) leg(0x%p) replaced old SDP=%s\n", leg->call->id, leg,
+		 osmo_quote_str(leg->rx_sdp, -1));
+	call_leg_flush_sdp_cache(leg);
+	talloc_unlink(leg, leg->rx_sdp);
+	leg->rx_sdp = talloc_strndup(leg, rx_sdp, len);
+	leg->rx_sdp_len = leg->rx_sdp ? len : 0;
+	leg->rx_sdp_hash = hash;
 	leg->rx_sdp_changed = true;
 }
@@ -1,23 +1,42 @@
 #pragma once
 
 #include "mncc_protocol.h"
+#include "timer_wheel.h"
 
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
+#include <osmocom/core/rate_ctr.h>
 #include <osmocom/core/timer.h>
 #include <osmocom/core/utils.h>
 #include <osmocom/gsm/gsm29205.h>
 
 #include <stdbool.h>
+#include <time.h>
 #include <netinet/in.h>
 
 struct sip_agent;
+struct sip_trunk;
 struct mncc_connection;
 
 
 struct nua_handle_s;
 
+/* Number of sdp_mode_t values: inactive, sendonly, recvonly, sendrecv */
+#define CALL_LEG_SDP_MODES	4
+
 struct call_leg;
 
+/* Call setup transitions, listed in the order of an MO call */
+enum call_setup_ts {
+	CALL_TS_SETUP,		/* MNCC_SETUP_IND or INVITE received */
+	CALL_TS_RTP_CREATE,	/* MNCC_RTP_CREATE answered by the MSC */
+	CALL_TS_INVITE,		/* INVITE or MNCC_SETUP_REQ sent */
+	CALL_TS_RINGING,	/* 180/183 or MNCC_ALERT_IND received */
+	CALL_TS_ANSWER,		/* 200 OK or MNCC_SETUP_CNF received */
+	CALL_TS_CONNECTED,	/* MNCC_SETUP_COMPL_IND or ACK received */
+	_NUM_CALL_TS
+};
+
 /**
  * One instance of a call with two legs. The initial
  * field will always be used by the entity that has
@@ -36,6 +55,13 @@ struct call {
 	/* Global Call Reference */
 	struct osmo_gcr_parsed gcr;
 	bool gcr_present;
+
+	/* for the call counters: answered, and the first release cause seen on a leg */
+	bool connected;
+	int cause;
+
+	/* CLOCK_MONOTONIC time of each setup transition, zero if not reached (yet) */
+	struct timespec setup_ts[_NUM_CALL_TS];
 };
 
 enum {
@@ -61,12 +87,19 @@ struct call_leg {
 
 	/* SDP as received for this call leg. If this is an MNCC call leg, contains the SDP most recently received in an
 	 * MNCC message; if this is a SIP call leg, contains the SDP most recently received in a SIP message. If no SDP
-	 * was received yet, this string is empty. Otherwise a nul terminated string. */
-	char rx_sdp[1024];
-	/* If the contents of rx_sdp[] changes, set rx_sdp_changed = true. When the other call leg transmits the next
+	 * was received yet, this is NULL. Otherwise a nul terminated string allocated to size on the leg, which entries
+	 * of sdp_cache[] may share through a talloc reference; release it with talloc_unlink(). */
+	char *rx_sdp;
+	/* Length and hash of rx_sdp, so that unchanged SDP is usually told apart without comparing the strings */
+	size_t rx_sdp_len;
+	uint32_t rx_sdp_hash;
+	/* If the contents of rx_sdp changes, set rx_sdp_changed = true. When the other call leg transmits the next
 	 * message, it can decide whether to include SDP because there is new information, or whether to omit SDP
 	 * because it was already sent identically earlier. */
 	bool rx_sdp_changed;
+	/* SDP rendered from rx_sdp by sdp_create_file() for the other call leg, indexed by sdp_mode_t. Owned by this
+	 * leg (or a reference to rx_sdp if that needs no change) and dropped whenever rx_sdp changes. */
+	char *sdp_cache[CALL_LEG_SDP_MODES];
 
 	/**
 	 * Remote started to ring/alert
@@ -122,17 +155,18 @@ struct sip_call_leg {
 
 	/* back pointer */
 	struct sip_agent *agent;
+	/* the remote an outgoing call was sent to, NULL once it is removed */
+	struct sip_trunk *trunk;
 
 	/* per instance members */
 	struct nua_handle_s *nua_handle;
+	/* entry in the nua_handle index, see call_sip_leg_find() */
+	struct hlist_node nua_handle_entry;
 	enum sip_cc_state state;
 	enum sip_dir dir;
 
 	/* mo field */
 	const char *wanted_codec;
-
-	/* mt field */
-	const char *sdp_payload;
 };
 
 enum mncc_cc_state {
@@ -154,11 +188,13 @@ struct mncc_call_leg {
 	enum mncc_dir dir;
 
 	uint32_t callref;
+	/* entry in the callref index, see call_mncc_leg_find(). Callrefs are only unique per MSC. */
+	struct hlist_node callref_entry;
 	struct gsm_mncc_number called;
 	struct gsm_mncc_number calling;
 	char imsi[16];
 
-	struct osmo_timer_list cmd_timeout;
+	struct timer_wheel_entry cmd_timeout;
 	int rsp_wanted;
 
 	struct mncc_connection *conn;
@@ -166,18 +202,102 @@ struct mncc_call_leg {
 	int cause;
 };
 
+/* Recycled objects of one size class, see call.c */
+struct call_pool {
+	const char *name;
+	size_t size;
+
+	void *free_list;
+	unsigned int idle;
+	unsigned int in_use;
+	unsigned int peak;
+
+	/* allocations served from the free list vs. from talloc */
+	unsigned long long hits;
+	unsigned long long misses;
+};
+
+enum {
+	CALL_POOL_CALL,
+	CALL_POOL_SIP_LEG,
+	CALL_POOL_MNCC_LEG,
+	_NUM_CALL_POOLS
+};
+
+extern struct call_pool g_call_pools[_NUM_CALL_POOLS];
+void call_pools_resize(void);
+
 extern struct llist_head g_call_list;
+/* calls that have not been connected yet */
+extern unsigned int g_calls_in_setup;
 void calls_init(void);
+void calls_set_id_space(unsigned int index, unsigned int count, unsigned int incarnation);
+
+/* Call lifecycle counters. MO calls are originated by the MS (MNCC_SETUP_IND), MT calls by the SIP side. */
+enum call_ctr {
+	CALL_CTR_MO_ATTEMPT,
+	CALL_CTR_MO_CONNECT,
+	CALL_CTR_MT_ATTEMPT,
+	CALL_CTR_MT_CONNECT,
+	CALL_CTR_REJECTED,
+	CALL_CTR_REJECTED_UNASSIGNED_NR,
+	CALL_CTR_REJECTED_NO_ROUTE,
+	CALL_CTR_REJECTED_CHAN_UNACCEPT,
+	CALL_CTR_REJECTED_NORM_CALL_CLEAR,
+	CALL_CTR_REJECTED_USER_BUSY,
+	CALL_CTR_REJECTED_USER_NOTRESPOND,
+	CALL_CTR_REJECTED_USER_ALERTING_NA,
+	CALL_CTR_REJECTED_CALL_REJECTED,
+	CALL_CTR_REJECTED_NORMAL_UNSPEC,
+	CALL_CTR_REJECTED_TEMP_FAILURE,
+	CALL_CTR_REJECTED_SWITCH_CONG,
+	CALL_CTR_REJECTED_RESOURCE_UNAVAIL,
+	CALL_CTR_REJECTED_OTHER,
+	CALL_CTR_SIP_INVITE_2XX,
+	CALL_CTR_SIP_INVITE_3XX,
+	CALL_CTR_SIP_INVITE_4XX,
+	CALL_CTR_SIP_INVITE_5XX,
+	CALL_CTR_SIP_INVITE_6XX,
+	CALL_CTR_HOLD,
+	CALL_CTR_RETRIEVE,
+	CALL_CTR_DTMF,
+};
+
+extern struct rate_ctr_group *g_call_ctrs;
+
+static inline void call_ctr_inc(enum call_ctr ctr)
+{
+	rate_ctr_inc2(g_call_ctrs, ctr);
+}
+
+void call_ctr_rejected(int cause);
+void call_ctr_sip_final(int status);
+
+void call_stamp(struct call *call, enum call_setup_ts ts);
+bool call_stamped(const struct call *call, enum call_setup_ts ts);
+extern const struct value_string call_setup_ts_names[];
 
 struct call_leg *call_leg_other(struct call_leg *leg);
 
 void call_leg_rx_sdp(struct call_leg *cl, const char *rx_sdp);
+void call_leg_flush_sdp_cache(struct call_leg *cl);
 
 void call_leg_release(struct call_leg *leg);
 
+struct sip_call_leg *call_sip_leg_alloc(struct call *call);
+struct mncc_call_leg *call_mncc_leg_alloc(struct call *call);
+void call_leg_free(struct call_leg *leg);
+
 
-struct call *call_mncc_create(void);
+struct call *call_mncc_create(struct mncc_connection *conn, uint32_t callref);
 struct call *call_sip_create(void);
+void call_connected(struct call *call);
+
+void call_mncc_leg_add(struct mncc_call_leg *leg);
+struct mncc_call_leg *call_mncc_leg_find(const struct mncc_connection *conn, uint32_t callref);
+
+void call_sip_leg_add(struct sip_call_leg *leg);
+struct sip_call_leg *call_sip_leg_find(const struct nua_handle_s *nh);
 
 const char *call_leg_type(struct call_leg *leg);
 const char *call_leg_state(struct call_leg *leg);
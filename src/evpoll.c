@@ -26,8 +26,43 @@
 
 #include <sys/select.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+static struct timeval *evpoll_timeout(int timeout, struct timeval *null_tv, struct timeval *poll_tv)
+{
+	struct timeval *tv;
+
+	/*
+	 * 0 == wake-up immediately
+	 * -1 == block forever.. which will depend on our timers
+	 */
+	if (timeout == 0) {
+		tv = null_tv;
+	} else if (timeout == -1) {
+		tv = osmo_timers_nearest();
+	} else {
+		poll_tv->tv_sec = timeout / 1000;
+		poll_tv->tv_usec = (timeout % 1000) * 1000;
+
+		tv = osmo_timers_nearest();
+		if (!tv)
+			tv = poll_tv;
+		else if (timercmp(poll_tv, tv, <))
+			tv = poll_tv;
+	}
+
+	return tv;
+}
+
 /* based on osmo_select_main GPLv2+ so combined compatible with AGPLv3+ */
-int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static int evpoll_select(struct pollfd *fds, nfds_t nfds, int timeout)
 {
 	struct timeval *tv, null_tv = { 0, 0} , poll_tv;
 	fd_set readset, writeset, exceptset;
@@ -62,24 +97,7 @@ int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 	osmo_timers_check();
 	osmo_timers_prepare();
 
-	/*
-	 * 0 == wake-up immediately
-	 * -1 == block forever.. which will depend on our timers
-	 */
-	if (timeout == 0) {
-		tv = &null_tv;
-	} else if (timeout == -1) {
-		tv = osmo_timers_nearest();
-	} else {
-		poll_tv.tv_sec = timeout / 1000;
-		poll_tv.tv_usec = (timeout % 1000) * 1000;
-
-		tv = osmo_timers_nearest();
-		if (!tv)
-			tv = &poll_tv;
-		else if (timercmp(&poll_tv, tv, <))
-			tv = &poll_tv;
-	}
+	tv = evpoll_timeout(timeout, &null_tv, &poll_tv);
 
 	rc = select(maxfd+1, &readset, &writeset, &exceptset, tv);
 	if (rc < 0)
@@ -107,3 +125,316 @@ int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 
 	return rc;
 }
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * epoll backend. The kernel keeps the interest set across iterations and
+ * we only issue epoll_ctl() for file descriptors whose wanted events have
+ * changed since the previous call. The fds wanted in an iteration are
+ * collected in a list and only these plus the ones registered in the
+ * previous iteration are looked at, never the whole table.
+ *
+ * Neither glib nor libosmocore tell us when a descriptor is closed. If the
+ * number is re-used before the next iteration the kernel has dropped the
+ * registration while our table still has it. The table therefore keeps the
+ * owner next to the registered events, the struct osmo_fd for libosmocore
+ * and none for glib, and a number is registered again when either of them
+ * changes. A descriptor that reported a hangup, a closing peer or an error
+ * is about to be closed by its owner and is checked once more in the next
+ * iteration. A number closed and re-used by the same owner with the same
+ * events in between two iterations without any of that is not noticed.
+ * glib only passes copies of its GPollFDs, so it has no owner to tell
+ * them apart.
+ */
+struct evpoll_fd {
+	/* events currently registered with the kernel, 0 if not registered */
+	uint32_t events;
+	/* events wanted in the current iteration */
+	uint32_t want;
+	/* events reported by epoll_wait() in the current iteration */
+	uint32_t revents;
+
+	/* iteration in which want/revents were last updated */
+	unsigned int seen;
+	unsigned int ready;
+
+	/* the libosmocore owner when it was registered, NULL for glib */
+	struct osmo_fd *owner;
+	/* the libosmocore owner in the current iteration */
+	struct osmo_fd *ofd;
+	/* this is a libosmocore fd and not a glib one */
+	bool osmo;
+	/* reported a hangup or error, re-check the kernel registration */
+	bool hangup;
+};
+
+static int epoll_fd = -1;
+static struct evpoll_fd *fd_table;
+static struct epoll_event *ep_events;
+static int fd_table_size;
+static unsigned int iteration;
+
+/* fds wanted in this iteration and fds registered with the kernel */
+static int *fd_wanted;
+static int nr_wanted;
+static int *fd_active;
+static int nr_active;
+
+static int evpoll_grow(int fd)
+{
+	int new_size = fd_table_size ? fd_table_size : 64;
+	struct evpoll_fd *new_table;
+	struct epoll_event *new_events;
+	int *new_wanted, *new_active;
+
+	while (new_size <= fd)
+		new_size *= 2;
+
+	new_table = realloc(fd_table, new_size * sizeof(*fd_table));
+	if (!new_table)
+		return -1;
+	fd_table = new_table;
+	memset(&fd_table[fd_table_size], 0, (new_size - fd_table_size) * sizeof(*fd_table));
+
+	new_events = realloc(ep_events, new_size * sizeof(*ep_events));
+	if (!new_events)
+		return -1;
+	ep_events = new_events;
+
+	new_wanted = realloc(fd_wanted, new_size * sizeof(*fd_wanted));
+	if (!new_wanted)
+		return -1;
+	fd_wanted = new_wanted;
+
+	new_active = realloc(fd_active, new_size * sizeof(*fd_active));
+	if (!new_active)
+		return -1;
+	fd_active = new_active;
+
+	fd_table_size = new_size;
+	return 0;
+}
+
+static struct evpoll_fd *evpoll_fd_get(int fd)
+{
+	struct evpoll_fd *entry;
+
+	if (fd >= fd_table_size && evpoll_grow(fd) < 0)
+		return NULL;
+
+	entry = &fd_table[fd];
+	if (entry->seen != iteration) {
+		entry->seen = iteration;
+		entry->want = 0;
+		entry->ofd = NULL;
+		entry->osmo = false;
+		fd_wanted[nr_wanted++] = fd;
+	}
+	return entry;
+}
+
+static void evpoll_fd_sync(int fd, struct evpoll_fd *entry)
+{
+	struct epoll_event ev = { 0, };
+	uint32_t want = entry->seen == iteration ? entry->want : 0;
+	struct osmo_fd *ofd = entry->seen == iteration ? entry->ofd : NULL;
+	int rc;
+
+	if (want == entry->events && ofd == entry->owner && !entry->hangup)
+		return;
+	entry->hangup = false;
+
+	if (want == 0) {
+		/* The fd might be closed already and the kernel dropped it. */
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		entry->events = 0;
+		entry->owner = NULL;
+		return;
+	}
+
+	/* a new owner has a new file behind the number, the old one is gone */
+	if (ofd != entry->owner)
+		entry->events = 0;
+	entry->owner = ofd;
+
+	/* a peer closing is the usual reason for the owner to close the fd */
+	ev.events = want | (want & EPOLLIN ? EPOLLRDHUP : 0);
+	ev.data.fd = fd;
+	if (entry->events == 0) {
+		rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		if (rc < 0 && errno == EEXIST)
+			rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	} else {
+		rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		if (rc < 0 && errno == ENOENT)
+			rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	entry->events = rc == 0 ? want : 0;
+}
+
+/*
+ * libosmocore only hands out its fds as fd_sets, so they remain limited to
+ * FD_SETSIZE. Walk the sets a word at a time to skip the empty ranges.
+ */
+static int evpoll_osmo_fds(void)
+{
+	fd_set readset, writeset, exceptset;
+	const unsigned long *rd = (const unsigned long *) &readset;
+	const unsigned long *wr = (const unsigned long *) &writeset;
+	const unsigned long *ex = (const unsigned long *) &exceptset;
+	const int bits = 8 * sizeof(unsigned long);
+	int maxfd, word;
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	FD_ZERO(&exceptset);
+	maxfd = osmo_fd_fill_fds(&readset, &writeset, &exceptset);
+	if (maxfd >= FD_SETSIZE)
+		maxfd = FD_SETSIZE - 1;
+
+	for (word = 0; word <= maxfd / bits; ++word) {
+		unsigned long pending = rd[word] | wr[word] | ex[word];
+
+		while (pending) {
+			int fd = word * bits + __builtin_ctzl(pending);
+			struct evpoll_fd *entry;
+			uint32_t want = 0;
+
+			pending &= pending - 1;
+
+			if (FD_ISSET(fd, &readset))
+				want |= EPOLLIN;
+			if (FD_ISSET(fd, &writeset))
+				want |= EPOLLOUT;
+			if (FD_ISSET(fd, &exceptset))
+				want |= EPOLLPRI;
+
+			entry = evpoll_fd_get(fd);
+			if (!entry)
+				return -1;
+			entry->want |= want;
+			entry->osmo = true;
+			entry->ofd = osmo_fd_get_by_fd(fd);
+		}
+	}
+
+	return 0;
+}
+
+static int evpoll_epoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct timeval *tv, null_tv = { 0, 0 }, poll_tv;
+	struct evpoll_fd *entry;
+	int fd, rc, i, ms, active;
+
+	iteration += 1;
+	nr_wanted = 0;
+
+	if (evpoll_osmo_fds() < 0)
+		return evpoll_select(fds, nfds, timeout);
+
+	for (i = 0; i < nfds; ++i) {
+		if (fds[i].fd < 0)
+			continue;
+		if ((fds[i].events & (POLLIN | POLLOUT | POLLPRI)) == 0)
+			continue;
+
+		entry = evpoll_fd_get(fds[i].fd);
+		if (!entry)
+			return evpoll_select(fds, nfds, timeout);
+		entry->want |= fds[i].events & (POLLIN | POLLOUT | POLLPRI);
+	}
+
+	if (fd_table_size == 0)
+		return evpoll_select(fds, nfds, timeout);
+
+	/* drop what was registered but is not wanted anymore */
+	for (i = 0; i < nr_active; ++i) {
+		fd = fd_active[i];
+		if (fd_table[fd].seen != iteration)
+			evpoll_fd_sync(fd, &fd_table[fd]);
+	}
+
+	/* and only touch the kernel for what has changed */
+	nr_active = 0;
+	for (i = 0; i < nr_wanted; ++i) {
+		fd = fd_wanted[i];
+		evpoll_fd_sync(fd, &fd_table[fd]);
+		if (fd_table[fd].events)
+			fd_active[nr_active++] = fd;
+	}
+
+	osmo_timers_check();
+	osmo_timers_prepare();
+
+	tv = evpoll_timeout(timeout, &null_tv, &poll_tv);
+	if (!tv)
+		ms = -1;
+	else
+		ms = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+
+	active = nr_active > 0 ? nr_active : 1;
+	rc = epoll_wait(epoll_fd, ep_events, active, ms);
+	if (rc < 0)
+		rc = 0;
+
+	/* fire timers */
+	osmo_timers_update();
+
+	for (i = 0; i < rc; ++i) {
+		struct osmo_fd *ofd;
+		unsigned int what = 0;
+
+		fd = ep_events[i].data.fd;
+		entry = &fd_table[fd];
+		entry->revents = ep_events[i].events;
+		entry->ready = iteration;
+		if (entry->revents & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+			entry->hangup = true;
+
+		if (!entry->osmo)
+			continue;
+
+		/* look it up again as earlier callbacks might have closed it */
+		ofd = osmo_fd_get_by_fd(fd);
+		if (!ofd)
+			continue;
+
+		if (entry->revents & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			what |= OSMO_FD_READ;
+		if (entry->revents & EPOLLOUT)
+			what |= OSMO_FD_WRITE;
+		if (entry->revents & EPOLLPRI)
+			what |= OSMO_FD_EXCEPT;
+		what &= ofd->when;
+		if (what)
+			ofd->cb(ofd, what);
+	}
+
+	for (i = 0; i < nfds; ++i) {
+		fds[i].revents = 0;
+
+		if (fds[i].fd < 0 || fds[i].fd >= fd_table_size)
+			continue;
+
+		entry = &fd_table[fds[i].fd];
+		if (entry->ready != iteration)
+			continue;
+		fds[i].revents = entry->revents & (fds[i].events | POLLERR | POLLHUP);
+	}
+
+	return rc;
+}
+#endif
+
+int evpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (epoll_fd < 0)
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd >= 0)
+		return evpoll_epoll(fds, nfds, timeout);
+#endif
+	return evpoll_select(fds, nfds, timeout);
+}
@@ -0,0 +1,207 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "latency.h"
+
+#include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/stat_item.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/gsm/mncc.h>
+
+#include <sofia-sip/nua.h>
+
+const uint32_t latency_bucket_us[LATENCY_NUM_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+
+static const struct rate_ctr_desc latency_ctr_desc[LATENCY_NUM_BUCKETS] = {
+	{ "dispatch:le50us",	"Messages handled within 50us" },
+	{ "dispatch:le100us",	"Messages handled within 100us" },
+	{ "dispatch:le250us",	"Messages handled within 250us" },
+	{ "dispatch:le500us",	"Messages handled within 500us" },
+	{ "dispatch:le1ms",	"Messages handled within 1ms" },
+	{ "dispatch:le2500us",	"Messages handled within 2.5ms" },
+	{ "dispatch:le5ms",	"Messages handled within 5ms" },
+	{ "dispatch:le10ms",	"Messages handled within 10ms" },
+	{ "dispatch:gt10ms",	"Messages that took longer than 10ms" },
+};
+
+static const struct rate_ctr_group_desc latency_ctrg_desc[_NUM_LATENCY_PATHS] = {
+	[LATENCY_MNCC] = {
+		.group_name_prefix = "mncc",
+		.group_description = "MNCC message handling time",
+		.class_id = OSMO_STATS_CLASS_GLOBAL,
+		.num_ctr = ARRAY_SIZE(latency_ctr_desc),
+		.ctr_desc = latency_ctr_desc,
+	},
+	[LATENCY_SIP] = {
+		.group_name_prefix = "sip",
+		.group_description = "SIP event handling time",
+		.class_id = OSMO_STATS_CLASS_GLOBAL,
+		.num_ctr = ARRAY_SIZE(latency_ctr_desc),
+		.ctr_desc = latency_ctr_desc,
+	},
+};
+
+static const struct osmo_stat_item_desc latency_stat_desc[] = {
+	{ "dispatch:time", "Time spent handling one message", "us", 16, 0 },
+};
+
+static const struct osmo_stat_item_group_desc latency_statg_desc[_NUM_LATENCY_PATHS] = {
+	[LATENCY_MNCC] = {
+		.group_name_prefix = "mncc",
+		.group_description = "MNCC message handling time",
+		.class_id = OSMO_STATS_CLASS_GLOBAL,
+		.num_items = ARRAY_SIZE(latency_stat_desc),
+		.item_desc = latency_stat_desc,
+	},
+	[LATENCY_SIP] = {
+		.group_name_prefix = "sip",
+		.group_description = "SIP event handling time",
+		.class_id = OSMO_STATS_CLASS_GLOBAL,
+		.num_items = ARRAY_SIZE(latency_stat_desc),
+		.item_desc = latency_stat_desc,
+	},
+};
+
+const uint32_t setup_delay_bucket_ms[LATENCY_NUM_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2000, 5000, 10000, 30000,
+};
+
+static const struct osmo_stat_item_desc setup_delay_stat_desc[_NUM_SETUP_DELAYS] = {
+	[SETUP_DELAY_PDD] = { "setup:pdd", "Post dial delay of a call", "ms", 16, 0 },
+	[SETUP_DELAY_ANSWER] = { "setup:answer", "Answer delay of a call", "ms", 16, 0 },
+};
+
+static const struct osmo_stat_item_group_desc setup_delay_statg_desc = {
+	.group_name_prefix = "call",
+	.group_description = "Call setup delays",
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+	.num_items = ARRAY_SIZE(setup_delay_stat_desc),
+	.item_desc = setup_delay_stat_desc,
+};
+
+static struct osmo_stat_item_group *setup_delay_statg;
+
+struct setup_delay_hist g_setup_delay[_NUM_SETUP_DELAYS] = {
+	[SETUP_DELAY_PDD] = { .name = "Post dial delay" },
+	[SETUP_DELAY_ANSWER] = { .name = "Answer delay" },
+};
+
+static const char *sip_event_name(uint32_t event)
+{
+	return nua_event_name(event);
+}
+
+struct latency_stats g_latency[_NUM_LATENCY_PATHS] = {
+	[LATENCY_MNCC] = {
+		.name = "MNCC",
+		.type_name = osmo_mncc_name,
+	},
+	[LATENCY_SIP] = {
+		.name = "SIP",
+		.type_name = sip_event_name,
+	},
+};
+
+void latency_init(void *ctx)
+{
+	int i;
+
+	for (i = 0; i < _NUM_LATENCY_PATHS; ++i) {
+		g_latency[i].ctrg = rate_ctr_group_alloc(ctx, &latency_ctrg_desc[i], 0);
+		g_latency[i].statg = osmo_stat_item_group_alloc(ctx, &latency_statg_desc[i], 0);
+	}
+	setup_delay_statg = osmo_stat_item_group_alloc(ctx, &setup_delay_statg_desc, 0);
+}
+
+static struct latency_hist *latency_hist(struct latency_stats *stats, uint32_t type)
+{
+	struct latency_hist *hist;
+	unsigned int i;
+
+	for (i = 0; i < stats->num_hists; ++i) {
+		if (stats->hists[i].type == type)
+			return &stats->hists[i];
+	}
+
+	if (stats->num_hists == ARRAY_SIZE(stats->hists))
+		return NULL;
+
+	hist = &stats->hists[stats->num_hists++];
+	hist->type = type;
+	return hist;
+}
+
+/* Account the time since 'start' to the given message type / event */
+void latency_record(enum latency_path path, uint32_t type, const struct timespec *start)
+{
+	struct latency_stats *stats = &g_latency[path];
+	struct latency_hist *hist;
+	struct timespec now;
+	uint32_t us;
+	int bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+
+	for (bucket = 0; bucket < ARRAY_SIZE(latency_bucket_us); ++bucket) {
+		if (us <= latency_bucket_us[bucket])
+			break;
+	}
+
+	if (stats->ctrg)
+		rate_ctr_inc2(stats->ctrg, bucket);
+	if (stats->statg)
+		osmo_stat_item_set(osmo_stat_item_group_get_item(stats->statg, 0), us);
+
+	/* more types than expected, only the totals above see it */
+	hist = latency_hist(stats, type);
+	if (!hist)
+		return;
+
+	hist->count += 1;
+	hist->total_us += us;
+	hist->buckets[bucket] += 1;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+
+/* Account the time between two call setup timestamps */
+void setup_delay_record(enum setup_delay delay, const struct timespec *from, const struct timespec *to)
+{
+	struct setup_delay_hist *hist = &g_setup_delay[delay];
+	uint32_t ms;
+	int bucket;
+
+	ms = (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+
+	for (bucket = 0; bucket < ARRAY_SIZE(setup_delay_bucket_ms); ++bucket) {
+		if (ms <= setup_delay_bucket_ms[bucket])
+			break;
+	}
+
+	if (setup_delay_statg)
+		osmo_stat_item_set(osmo_stat_item_group_get_item(setup_delay_statg, delay), ms);
+
+	hist->count += 1;
+	hist->total_ms += ms;
+	hist->buckets[bucket] += 1;
+	if (ms > hist->max_ms)
+		hist->max_ms = ms;
+}
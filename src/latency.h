@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+struct rate_ctr_group;
+struct osmo_stat_item_group;
+
+/*
+ * Handling time of received MNCC messages and sofia-sip events, kept
+ * in fixed buckets per message type / nua_event_t.
+ */
+enum latency_path {
+	LATENCY_MNCC,
+	LATENCY_SIP,
+	_NUM_LATENCY_PATHS
+};
+
+/* upper bounds in microseconds, the last bucket takes everything above */
+#define LATENCY_NUM_BUCKETS	9
+extern const uint32_t latency_bucket_us[LATENCY_NUM_BUCKETS - 1];
+
+#define LATENCY_MAX_TYPES	48
+
+struct latency_hist {
+	uint32_t type;
+	uint64_t count;
+	uint64_t total_us;
+	uint32_t max_us;
+	uint64_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+struct latency_stats {
+	const char *name;
+	const char *(*type_name)(uint32_t type);
+
+	struct latency_hist hists[LATENCY_MAX_TYPES];
+	unsigned int num_hists;
+
+	/* all types together, for the osmo_stats reporters */
+	struct rate_ctr_group *ctrg;
+	struct osmo_stat_item_group *statg;
+};
+
+extern struct latency_stats g_latency[_NUM_LATENCY_PATHS];
+
+/*
+ * Call setup delays, taken from the setup timestamps of each call. Post
+ * dial delay runs from the setup to the first ringing (or the answer if
+ * there was no ringing), answer delay from the ringing to the answer.
+ */
+enum setup_delay {
+	SETUP_DELAY_PDD,
+	SETUP_DELAY_ANSWER,
+	_NUM_SETUP_DELAYS
+};
+
+/* upper bounds in milliseconds, the last bucket takes everything above */
+extern const uint32_t setup_delay_bucket_ms[LATENCY_NUM_BUCKETS - 1];
+
+struct setup_delay_hist {
+	const char *name;
+	uint64_t count;
+	uint64_t total_ms;
+	uint32_t max_ms;
+	uint64_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+extern struct setup_delay_hist g_setup_delay[_NUM_SETUP_DELAYS];
+
+void latency_init(void *ctx);
+void latency_record(enum latency_path path, uint32_t type, const struct timespec *start);
+void setup_delay_record(enum setup_delay delay, const struct timespec *from, const struct timespec *to);
+
+static inline void latency_start(struct timespec *start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
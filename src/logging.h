@@ -8,3 +8,15 @@ enum {
 	DAPP,	
 	DCALL,
 };
+
+/*
+ * Debug messages on the MNCC and SIP message paths. LOGP() already skips
+ * the arguments (quoted SDP and the like) unless the category logs at
+ * debug level, configure --disable-hot-path-debug removes the messages
+ * from the build altogether.
+ */
+#ifdef NO_HOT_PATH_DEBUG
+#define LOGP_HOT(ss, fmt, args...) do { } while (0)
+#else
+#define LOGP_HOT(ss, fmt, args...) LOGP(ss, LOGL_DEBUG, fmt, ##args)
+#endif
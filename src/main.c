@@ -26,6 +26,9 @@
 #include "mncc.h"
 #include "app.h"
 #include "call.h"
+#include "latency.h"
+#include "admission.h"
+#include "supervisor.h"
 
 #include <osmocom/core/application.h>
 #include <osmocom/core/utils.h>
@@ -40,6 +43,7 @@
 
 #include <sofia-sip/su_glib.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -47,6 +51,7 @@
 void *tall_mncc_ctx;
 
 static bool daemonize = false;
+static unsigned int num_workers = 0;
 static char *config_file = "osmo-sip-connector.cfg";
 
 static struct log_info_cat mncc_sip_categories[] = {
@@ -83,22 +88,25 @@ static void print_help(void)
 	printf("  -h --help\tThis text\n");
 	printf("  -c --config-file NAME\tThe config file to use [%s]\n", config_file);
 	printf("  -D --daemonize\tFork the process into a background daemon\n");
+	printf("  -w --workers N\tRun N (0-%d) worker processes under a supervisor\n",
+	       SUPERVISOR_MAX_WORKERS);
 	printf("  -V --version\tPrint the version number\n");
 }
 
 static void handle_options(int argc, char **argv)
 {
 	while (1) {
-		int option_index = 0, c;
+		int option_index = 0, c, workers;
 		static struct option long_options[] = {
 			{"help", 0, 0, 'h'},
 			{"config-file", 1, 0, 'c'},
 			{"daemonize", 0, 0, 'D'},
+			{"workers", 1, 0, 'w'},
 			{"version", 0, 0, 'V' },
 			{NULL, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hc:DV",
+		c = getopt_long(argc, argv, "hc:Dw:V",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -113,6 +121,14 @@ static void handle_options(int argc, char **argv)
 		case 'D':
 			daemonize = true;
 			break;
+		case 'w':
+			if (osmo_str_to_int(&workers, optarg, 10, 0, SUPERVISOR_MAX_WORKERS) < 0) {
+				fprintf(stderr, "Invalid number of workers '%s', expected 0 to %d\n",
+					optarg, SUPERVISOR_MAX_WORKERS);
+				exit(1);
+			}
+			num_workers = workers;
+			break;
 		case 'V':
 			print_version(1);
 			exit(EXIT_SUCCESS);
@@ -123,7 +139,7 @@ static void handle_options(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-	int rc;
+	int rc, worker;
 	GMainLoop *loop;
 
 	/* initialize osmocom */
@@ -131,6 +147,7 @@ int main(int argc, char **argv)
 	osmo_init_ignore_signals();
 	osmo_init_logging2(tall_mncc_ctx, &mncc_sip_info);
 	osmo_stats_init(tall_mncc_ctx);
+	latency_init(tall_mncc_ctx);
 
 	mncc_sip_vty_init();
 	logging_vty_add_cmds();
@@ -147,13 +164,26 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	rc = telnet_init_default(tall_mncc_ctx, NULL, OSMO_VTY_PORT_MNCC_SIP);
+	if (num_workers) {
+		/* the supervisor detaches before it starts the workers */
+		if (daemonize) {
+			rc = osmo_daemonize();
+			if (rc < 0) {
+				perror("Error during daemonize");
+				exit(1);
+			}
+			daemonize = false;
+		}
+
+		/* only returns in a worker */
+		worker = supervisor_run(&g_app, num_workers, OSMO_VTY_PORT_MNCC_SIP);
+		rc = telnet_init_dynif(tall_mncc_ctx, NULL, vty_get_bind_addr(),
+					g_worker_stats[worker].vty_port);
+	} else
+		rc = telnet_init_default(tall_mncc_ctx, NULL, OSMO_VTY_PORT_MNCC_SIP);
 	if (rc < 0)
 		exit(1);
 
-	mncc_connection_init(&g_app.mncc.conn, &g_app);
-	mncc_connection_start(&g_app.mncc.conn);
-
 	/* sofia sip */
 	sip_agent_init(&g_app.sip.agent, &g_app);
 	rc = sip_agent_start(&g_app.sip.agent);
@@ -164,7 +194,9 @@ int main(int argc, char **argv)
 	}
 
 	calls_init();
+	admission_init(tall_mncc_ctx);
 	app_setup(&g_app);
+	supervisor_worker_start();
 
 	if (daemonize) {
 		rc = osmo_daemonize();
@@ -18,14 +18,19 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "mncc.h"
 #include "mncc_protocol.h"
 #include "app.h"
 #include "logging.h"
 #include "call.h"
+#include "latency.h"
+#include "timer_wheel.h"
 
 #include <osmocom/gsm/protocol/gsm_03_40.h>
 
+#include <osmocom/core/msgb.h>
 #include <osmocom/core/socket.h>
 #include <osmocom/core/utils.h>
 
@@ -37,11 +42,19 @@
 
 extern void *tall_mncc_ctx;
 
+/* Messages waiting in the tx queue before we consider the MSC to be gone */
+#define MNCC_TX_QUEUE_MAX	4096
+/* Messages handed to the kernel with one sendmmsg() call */
+#define MNCC_TX_BATCH		32
+
+/* Command timeouts of all MNCC legs */
+static struct timer_wheel cmd_timers;
+
 static void close_connection(struct mncc_connection *conn);
 
 static void mncc_leg_release(struct mncc_call_leg *leg)
 {
-	osmo_timer_del(&leg->cmd_timeout);
+	timer_wheel_del(&cmd_timers, &leg->cmd_timeout);
 	call_leg_release(&leg->base);
 }
 
@@ -65,8 +78,8 @@ static void start_cmd_timer(struct mncc_call_leg *leg, uint32_t expected_next)
 
 	leg->cmd_timeout.cb = cmd_timeout;
 	leg->cmd_timeout.data = leg;
-	LOGP(DMNCC, LOGL_DEBUG, "Starting Timer for %s\n", osmo_mncc_name(expected_next));
-	osmo_timer_schedule(&leg->cmd_timeout, 5, 0);
+	LOGP_HOT(DMNCC, "Starting Timer for %s\n", osmo_mncc_name(expected_next));
+	timer_wheel_add(&cmd_timers, &leg->cmd_timeout, leg->conn->app->mncc.cmd_timeout * 1000);
 }
 
 static void stop_cmd_timer(struct mncc_call_leg *leg, uint32_t got_res)
@@ -77,37 +90,22 @@ static void stop_cmd_timer(struct mncc_call_leg *leg, uint32_t got_res)
 		return;
 	}
 
-	LOGP(DMNCC, LOGL_DEBUG,
+	LOGP_HOT(DMNCC,
 		"Got response(%s), stopping timer on leg(%u)\n",
 		osmo_mncc_name(got_res), leg->callref);
-	osmo_timer_del(&leg->cmd_timeout);
+	timer_wheel_del(&cmd_timers, &leg->cmd_timeout);
 }
 
 /* Find a MNCC Call leg (whether MO or MT) by given callref */
-static struct mncc_call_leg *mncc_find_leg(uint32_t callref)
+static struct mncc_call_leg *mncc_find_leg(struct mncc_connection *conn, uint32_t callref)
 {
-	struct call *call;
-
-	llist_for_each_entry(call, &g_call_list, entry) {
-		if (call->initial && call->initial->type == CALL_TYPE_MNCC) {
-			struct mncc_call_leg *leg = (struct mncc_call_leg *) call->initial;
-			if (leg->callref == callref)
-				return leg;
-		}
-		if (call->remote && call->remote->type == CALL_TYPE_MNCC) {
-			struct mncc_call_leg *leg = (struct mncc_call_leg *) call->remote;
-			if (leg->callref == callref)
-				return leg;
-		}
-	}
-
-	return NULL;
+	return call_mncc_leg_find(conn, callref);
 }
 
 /* Find a MNCC Call leg (by callref) which is not yet in release */
-static struct mncc_call_leg *mncc_find_leg_not_released(uint32_t callref)
+static struct mncc_call_leg *mncc_find_leg_not_released(struct mncc_connection *conn, uint32_t callref)
 {
-	struct mncc_call_leg *leg = mncc_find_leg(callref);
+	struct mncc_call_leg *leg = mncc_find_leg(conn, callref);
 	if (!leg)
 		return NULL;
 	if (leg->base.in_release)
@@ -115,14 +113,15 @@ static struct mncc_call_leg *mncc_find_leg_not_released(uint32_t callref)
 	return leg;
 }
 
-static void mncc_fill_header(struct gsm_mncc *mncc, uint32_t msg_type, uint32_t callref)
+static void mncc_fill_header(struct mncc_connection *conn, struct gsm_mncc *mncc,
+			     uint32_t msg_type, uint32_t callref)
 {
 	struct mncc_call_leg *mncc_leg;
 
 	mncc->msg_type = msg_type;
 	mncc->callref = callref;
 	if (MNCC_DISC_REQ == msg_type || MNCC_REL_REQ == msg_type) {
-		mncc_leg = mncc_find_leg(callref);
+		mncc_leg = mncc_find_leg(conn, callref);
 		mncc->fields |= MNCC_F_CAUSE;
 		mncc->cause.coding = GSM48_CAUSE_CODING_GSM;
 		mncc->cause.location = GSM48_CAUSE_LOC_PUN_S_LU;
@@ -130,48 +129,132 @@ static void mncc_fill_header(struct gsm_mncc *mncc, uint32_t msg_type, uint32_t
 	}
 }
 
-static int mncc_write(struct mncc_connection *conn, struct gsm_mncc *mncc)
+/* Queue a message for the MSC. It is sent once the socket is writable, see
+ * mncc_flush(). All messages queued within one iteration of the main loop
+ * are then handed to the kernel together. */
+static int mncc_queue(struct mncc_connection *conn, const void *data, size_t len, uint32_t callref)
 {
-	int rc;
+	struct msgb *msg;
 
-	LOGP(DMNCC, LOGL_DEBUG, "tx MNCC %s with SDP=%s\n", osmo_mncc_name(mncc->msg_type),
-	     osmo_quote_str(mncc->sdp, -1));
+	if (conn->fd.fd < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "Not connected, dropping message for call(%u)\n", callref);
+		return -1;
+	}
+
+	/* the connection is going away, nothing gets sent anymore */
+	if (osmo_timer_pending(&conn->close_timer))
+		return -1;
 
 	/*
-	 * TODO: we need to put cause in here for release or such? shall we return a
-	 * static struct?
+	 * We are called from within the call handlers. Closing the connection
+	 * right away would release the very call the caller is working on, so
+	 * leave that to a timer and only report the error.
 	 */
-	rc = write(conn->fd.fd, mncc, sizeof(*mncc));
-	if (rc != sizeof(*mncc)) {
-		LOGP(DMNCC, LOGL_ERROR, "Failed to send message for call(%u)\n", mncc->callref);
-		close_connection(conn);
+	if (conn->tx_queue_len >= MNCC_TX_QUEUE_MAX) {
+		LOGP(DMNCC, LOGL_ERROR, "Tx queue full, dropping message for call(%u)\n", callref);
+		osmo_timer_schedule(&conn->close_timer, 0, 0);
+		return -1;
+	}
+
+	msg = msgb_alloc(len, "MNCC tx");
+	if (!msg) {
+		LOGP(DMNCC, LOGL_ERROR, "Failed to allocate message for call(%u)\n", callref);
+		osmo_timer_schedule(&conn->close_timer, 0, 0);
+		return -1;
+	}
+	memcpy(msgb_put(msg, len), data, len);
+
+	msgb_enqueue(&conn->tx_queue, msg);
+	conn->tx_queue_len += 1;
+	osmo_fd_write_enable(&conn->fd);
+	return len;
+}
+
+/* Write as many queued messages as the socket takes without blocking */
+static void mncc_flush(struct mncc_connection *conn)
+{
+	struct mmsghdr mmsg[MNCC_TX_BATCH];
+	struct iovec iov[MNCC_TX_BATCH];
+	struct msgb *msg;
+	int count, rc, i;
+
+	while (!llist_empty(&conn->tx_queue)) {
+		count = 0;
+		llist_for_each_entry(msg, &conn->tx_queue, list) {
+			iov[count].iov_base = msg->data;
+			iov[count].iov_len = msg->len;
+			memset(&mmsg[count], 0, sizeof(mmsg[count]));
+			mmsg[count].msg_hdr.msg_iov = &iov[count];
+			mmsg[count].msg_hdr.msg_iovlen = 1;
+			if (++count == ARRAY_SIZE(mmsg))
+				break;
+		}
+
+		rc = sendmmsg(conn->fd.fd, mmsg, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (rc <= 0) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to send %d queued messages: %s\n",
+				conn->tx_queue_len, strerror(errno));
+			return close_connection(conn);
+		}
+
+		for (i = 0; i < rc; ++i) {
+			msg = msgb_dequeue(&conn->tx_queue);
+			conn->tx_queue_len -= 1;
+			if (mmsg[i].msg_len != msg->len) {
+				LOGP(DMNCC, LOGL_ERROR, "Short write %u vs. %u\n",
+					mmsg[i].msg_len, msg->len);
+				msgb_free(msg);
+				return close_connection(conn);
+			}
+			msgb_free(msg);
+		}
+
+		/* the kernel did not take everything, wait for the next POLLOUT */
+		if (rc < count)
+			return;
 	}
 
-	return rc;
+	osmo_fd_write_disable(&conn->fd);
+}
+
+static int mncc_write(struct mncc_connection *conn, struct gsm_mncc *mncc)
+{
+	LOGP_HOT(DMNCC, "tx MNCC %s with SDP=%s\n", osmo_mncc_name(mncc->msg_type),
+		 osmo_quote_str(mncc->sdp, -1));
+
+	/*
+	 * TODO: we need to put cause in here for release or such? shall we return a
+	 * static struct?
+	 */
+	return mncc_queue(conn, mncc, sizeof(*mncc), mncc->callref);
 }
 
 static int mncc_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref)
 {
 	struct gsm_mncc mncc = { 0, };
 
-	mncc_fill_header(&mncc, msg_type, callref);
+	mncc_fill_header(conn, &mncc, msg_type, callref);
 	return mncc_write(conn, &mncc);
 }
 
 static int mncc_rtp_write(struct mncc_connection *conn, struct gsm_mncc_rtp *rtp)
 {
-	int rc;
+	LOGP_HOT(DMNCC, "tx MNCC %s with SDP=%s\n", osmo_mncc_name(rtp->msg_type),
+		 osmo_quote_str(rtp->sdp, -1));
 
-	LOGP(DMNCC, LOGL_DEBUG, "tx MNCC %s with SDP=%s\n", osmo_mncc_name(rtp->msg_type),
-	     osmo_quote_str(rtp->sdp, -1));
+	return mncc_queue(conn, rtp, sizeof(*rtp), rtp->callref);
+}
 
-	rc = write(conn->fd.fd, rtp, sizeof(*rtp));
-	if (rc != sizeof(*rtp)) {
-		LOGP(DMNCC, LOGL_ERROR, "Failed to send message for call(%u): %d\n", rtp->callref, rc);
-		close_connection(conn);
-	}
+/* MNCC carries SDP in a fixed size field, complain instead of truncating silently */
+static void mncc_set_sdp(char *field, size_t field_len, const char *sdp, uint32_t callref)
+{
+	size_t len = osmo_strlcpy(field, sdp, field_len);
 
-	return rc;
+	if (len >= field_len)
+		LOGP(DMNCC, LOGL_ERROR, "leg(%u) SDP of %zu bytes does not fit into MNCC, truncated\n",
+		     callref, len);
 }
 
 static int mncc_rtp_send(struct mncc_connection *conn, uint32_t msg_type, uint32_t callref, const char *sdp)
@@ -181,7 +264,7 @@ static int mncc_rtp_send(struct mncc_connection *conn, uint32_t msg_type, uint32
 	mncc.msg_type = msg_type;
 	mncc.callref = callref;
 	if (sdp)
-		OSMO_STRLCPY_ARRAY(mncc.sdp, sdp);
+		mncc_set_sdp(mncc.sdp, sizeof(mncc.sdp), sdp, callref);
 
 	return mncc_rtp_write(conn, &mncc);
 }
@@ -203,7 +286,7 @@ static bool send_rtp_connect(struct mncc_call_leg *leg, struct call_leg *other)
 	mncc.payload_type = other->payload_type;
 
 	/* Forward whichever SDP was last received on the other call leg */
-	OSMO_STRLCPY_ARRAY(mncc.sdp, other->rx_sdp);
+	mncc_set_sdp(mncc.sdp, sizeof(mncc.sdp), other->rx_sdp, leg->callref);
 
 	/*
 	 * FIXME: mncc.payload_msg_type should already be compatible.. but
@@ -216,7 +299,6 @@ static bool send_rtp_connect(struct mncc_call_leg *leg, struct call_leg *other)
 	if (rc != sizeof(mncc)) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to send message for call(%u)\n",
 			leg->callref);
-		close_connection(leg->conn);
 		return false;
 	}
 	return true;
@@ -266,6 +348,8 @@ static void mncc_call_leg_connect(struct call_leg *_leg)
 
 	start_cmd_timer(leg, MNCC_SETUP_COMPL_IND);
 	mncc_send(leg->conn, MNCC_SETUP_RSP, leg->callref);
+	call_connected(leg->base.call);
+	call_ctr_inc(CALL_CTR_MO_CONNECT);
 }
 
 /* RING call-back for MNCC call leg */
@@ -278,7 +362,7 @@ static void mncc_call_leg_ring(struct call_leg *_leg)
 	OSMO_ASSERT(_leg->type == CALL_TYPE_MNCC);
 	leg = (struct mncc_call_leg *) _leg;
 
-	mncc_fill_header(&out_mncc, MNCC_ALERT_REQ, leg->callref);
+	mncc_fill_header(leg->conn, &out_mncc, MNCC_ALERT_REQ, leg->callref);
 	/* GSM 04.08 10.5.4.21 */
 	out_mncc.fields |= MNCC_F_PROGRESS;
 	out_mncc.progress.coding = GSM48_CAUSE_CODING_GSM; /* Standard defined for the GSM PLMNS */
@@ -318,7 +402,7 @@ static void mncc_call_leg_release(struct call_leg *_leg)
 			"Releasing call in initial-state leg(%u)\n", leg->callref);
 		if (leg->dir == MNCC_DIR_MO) {
 			mncc_send(leg->conn, MNCC_REJ_REQ, leg->callref);
-			osmo_timer_del(&leg->cmd_timeout);
+			timer_wheel_del(&cmd_timers, &leg->cmd_timeout);
 			mncc_leg_release(leg);
 		} else {
 			leg->base.in_release = true;
@@ -345,12 +429,18 @@ static void mncc_call_leg_release(struct call_leg *_leg)
 /* Close the MNCC connection/socket */
 static void close_connection(struct mncc_connection *conn)
 {
+	struct msgb *msg;
+
+	osmo_timer_del(&conn->close_timer);
 	if (conn->fd.fd < 0)
 		return;
 
 	osmo_fd_unregister(&conn->fd);
 	close(conn->fd.fd);
 	conn->fd.fd = -1;
+	while ((msg = msgb_dequeue(&conn->tx_queue)))
+		msgb_free(msg);
+	conn->tx_queue_len = 0;
 	osmo_timer_schedule(&conn->reconnect, 5, 0);
 	conn->state = MNCC_DISCONNECTED;
 	if (conn->on_disconnect)
@@ -398,20 +488,12 @@ static void continue_call(struct mncc_call_leg *leg)
 	return continue_mt_call(leg);
 }
 
-static void check_rtp_connect(struct mncc_connection *conn, const char *buf, int rc)
+static void check_rtp_connect(struct mncc_connection *conn, const struct gsm_mncc_rtp *rtp)
 {
-	const struct gsm_mncc_rtp *rtp;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	if (rc < sizeof(*rtp)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc_rtp of wrong size %d < %zu\n",
-			rc, sizeof(*rtp));
-		return close_connection(conn);
-	}
-
-	rtp = (const struct gsm_mncc_rtp *) buf;
-	leg = mncc_find_leg_not_released(rtp->callref);
+	leg = mncc_find_leg_not_released(conn, rtp->callref);
 	if (!leg) {
 		LOGP(DMNCC, LOGL_ERROR, "leg(%u) can not be found\n", rtp->callref);
 		mncc_send(conn, MNCC_REJ_REQ, rtp->callref);
@@ -434,20 +516,12 @@ static void check_rtp_connect(struct mncc_connection *conn, const char *buf, int
 	leg->base.release_call(&leg->base);
 }
 
-static void check_rtp_create(struct mncc_connection *conn, const char *buf, int rc)
+static void check_rtp_create(struct mncc_connection *conn, const struct gsm_mncc_rtp *rtp)
 {
-	const struct gsm_mncc_rtp *rtp;
 	struct mncc_call_leg *leg;
 	char ip_addr[INET6_ADDRSTRLEN];
 
-	if (rc < sizeof(*rtp)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc_rtp of wrong size %d < %zu\n",
-			rc, sizeof(*rtp));
-		return close_connection(conn);
-	}
-
-	rtp = (const struct gsm_mncc_rtp *) buf;
-	leg = mncc_find_leg_not_released(rtp->callref);
+	leg = mncc_find_leg_not_released(conn, rtp->callref);
 	if (!leg) {
 		LOGP(DMNCC, LOGL_ERROR, "call(%u) can not be found\n", rtp->callref);
 		mncc_send(conn, MNCC_REJ_REQ, rtp->callref);
@@ -468,6 +542,7 @@ static void check_rtp_create(struct mncc_connection *conn, const char *buf, int
 		osmo_sockaddr_port((const struct sockaddr*)&leg->base.addr),
 		leg->base.payload_type, leg->base.payload_msg_type);
 	stop_cmd_timer(leg, MNCC_RTP_CREATE);
+	call_stamp(leg->base.call, CALL_TS_RTP_CREATE);
 	continue_call(leg);
 }
 
@@ -491,10 +566,16 @@ static const struct gsm_mncc_number emergency_number = {
 	.number = "emergency",
 };
 
+/* Reject an MNCC_SETUP_IND before a call was created for it */
+static void reject_setup(struct mncc_connection *conn, uint32_t callref, int cause)
+{
+	call_ctr_rejected(cause);
+	mncc_send(conn, MNCC_REJ_REQ, callref);
+}
+
 /* Check + Process MNCC_SETUP_IND (MO call) */
-static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
+static void check_setup(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	const struct gsm_mncc_number *called;
 	struct call *call;
 	struct mncc_call_leg *leg;
@@ -502,14 +583,26 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 	const char *sdp = NULL;
 	struct osmo_gcr_parsed gcr;
 
-	if (rc < sizeof(*data)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc of wrong size %d vs. %zu\n",
-			rc, sizeof(*data));
-		return close_connection(conn);
+	called = &data->called;
+	call_ctr_inc(CALL_CTR_MO_ATTEMPT);
+
+	/* shed load before anything is allocated, but never for emergency calls */
+	if (!data->emergency && admission_check() != ADMISSION_OK) {
+		reject_setup(conn, data->callref, GSM48_CC_CAUSE_SWITCH_CONG);
+		return;
 	}
 
-	data = (const struct gsm_mncc *) buf;
-	called = &data->called;
+	/* don't occupy the MS with a call the SIP remote is known to fail */
+	if (!data->emergency) {
+		int cause = sip_agent_reject_cause(&g_app.sip.agent);
+
+		if (cause) {
+			LOGP(DMNCC, LOGL_NOTICE, "MNCC leg(%u) rejected, circuit breaker of the SIP remote is open\n",
+				data->callref);
+			reject_setup(conn, data->callref, cause);
+			return;
+		}
+	}
 
 	/* screen arguments */
 	if ((data->fields & MNCC_F_CALLED) == 0) {
@@ -517,7 +610,7 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 			LOGP(DMNCC, LOGL_ERROR,
 				"MNCC leg(%u) without called addr fields(%u)\n",
 				data->callref, data->fields);
-			mncc_send(conn, MNCC_REJ_REQ, data->callref);
+			reject_setup(conn, data->callref, GSM48_CC_CAUSE_INVAL_MAND_INF);
 			return;
 		}
 
@@ -529,7 +622,7 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 		LOGP(DMNCC, LOGL_ERROR,
 			"MNCC leg(%u) without calling addr fields(%u)\n",
 			data->callref, data->fields);
-		mncc_send(conn, MNCC_REJ_REQ, data->callref);
+		reject_setup(conn, data->callref, GSM48_CC_CAUSE_INVAL_MAND_INF);
 		return;
 	}
 
@@ -537,7 +630,7 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 	if (!continue_setup(conn, data)) {
 		LOGP(DMNCC, LOGL_ERROR,
 			"MNCC screening parameters failed leg(%u)\n", data->callref);
-		mncc_send(conn, MNCC_REJ_REQ, data->callref);
+		reject_setup(conn, data->callref, GSM48_CC_CAUSE_INV_NR_FORMAT);
 		return;
 	}
 
@@ -546,17 +639,17 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 		if (osmo_dec_gcr(&gcr, data->gcr, sizeof(data->gcr)) < 0) {
 			LOGP(DMNCC, LOGL_ERROR,
 				"MNCC leg(%u) failed to parse GCR\n", data->callref);
-			mncc_send(conn, MNCC_REJ_REQ, data->callref);
+			reject_setup(conn, data->callref, GSM48_CC_CAUSE_INVAL_MAND_INF);
 			return;
 		}
 	}
 
 	/* Create an RTP port and then allocate a call */
-	call = call_mncc_create();
+	call = call_mncc_create(conn, data->callref);
 	if (!call) {
 		LOGP(DMNCC, LOGL_ERROR,
 			"MNCC leg(%u) failed to allocate call\n", data->callref);
-		mncc_send(conn, MNCC_REJ_REQ, data->callref);
+		reject_setup(conn, data->callref, GSM48_CC_CAUSE_RESOURCE_UNAVAIL);
 		return;
 	}
 
@@ -565,7 +658,6 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 	leg->base.ring_call = mncc_call_leg_ring;
 	leg->base.release_call = mncc_call_leg_release;
 	leg->base.update_rtp = update_rtp;
-	leg->callref = data->callref;
 	leg->conn = conn;
 	leg->state = MNCC_CC_INITIAL;
 	leg->dir = MNCC_DIR_MO;
@@ -584,7 +676,7 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 		call->id, leg->callref, data->imsi);
 
 	other_leg = call_leg_other(&leg->base);
-	if (other_leg && *other_leg->rx_sdp && other_leg->rx_sdp_changed) {
+	if (other_leg && other_leg->rx_sdp && other_leg->rx_sdp_changed) {
 		sdp = other_leg->rx_sdp;
 		other_leg->rx_sdp_changed = false;
 	}
@@ -594,40 +686,28 @@ static void check_setup(struct mncc_connection *conn, const char *buf, int rc)
 }
 
 /*! Find MNCC Call leg by given MNCC message
- *  \param conn MNCC socket/connection
- *  \param[in] buf buffer containing MNCC message
- *  \param[in] rc length of message in \a buf
- *  \param[out] mncc return pointer to MNCC message
+ *  \param conn MNCC socket/connection the message was received on
+ *  \param[in] mncc received MNCC message
  *  \returns call leg (if found) or NULL */
-static struct mncc_call_leg *find_leg(struct mncc_connection *conn,
-					const char *buf, int rc, const struct gsm_mncc **mncc)
+static struct mncc_call_leg *find_leg(struct mncc_connection *conn, const struct gsm_mncc *mncc)
 {
 	struct mncc_call_leg *leg;
 
-	if (rc < sizeof(**mncc)) {
-		LOGP(DMNCC, LOGL_ERROR, "gsm_mncc of wrong size %d vs. %zu\n",
-			rc, sizeof(**mncc));
-		close_connection(conn);
-		return NULL;
-	}
-
-	*mncc = (const struct gsm_mncc *) buf;
-	leg = mncc_find_leg((*mncc)->callref);
+	leg = mncc_find_leg(conn, mncc->callref);
 	if (!leg) {
-		LOGP(DMNCC, LOGL_ERROR, "call(%u) can not be found\n", (*mncc)->callref);
+		LOGP(DMNCC, LOGL_ERROR, "call(%u) can not be found\n", mncc->callref);
 		return NULL;
 	}
 
 	return leg;
 }
 
-static void check_disc_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_disc_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -646,12 +726,11 @@ static void check_disc_ind(struct mncc_connection *conn, const char *buf, int rc
 	}
 }
 
-static void check_rel_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_rel_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -671,12 +750,11 @@ static void check_rel_ind(struct mncc_connection *conn, const char *buf, int rc)
 	mncc_leg_release(leg);
 }
 
-static void check_rel_cnf(struct mncc_connection *conn, const char *buf, int rc)
+static void check_rel_cnf(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -685,12 +763,11 @@ static void check_rel_cnf(struct mncc_connection *conn, const char *buf, int rc)
 	mncc_leg_release(leg);
 }
 
-static void check_stp_cmpl_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_stp_cmpl_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -698,16 +775,16 @@ static void check_stp_cmpl_ind(struct mncc_connection *conn, const char *buf, in
 
 	LOGP(DMNCC, LOGL_INFO, "leg(%u) is now connected.\n", leg->callref);
 	stop_cmd_timer(leg, MNCC_SETUP_COMPL_IND);
+	call_stamp(leg->base.call, CALL_TS_CONNECTED);
 	leg->state = MNCC_CC_CONNECTED;
 }
 
-static void check_rej_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_rej_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -721,14 +798,13 @@ static void check_rej_ind(struct mncc_connection *conn, const char *buf, int rc)
 	mncc_leg_release(leg);
 }
 
-static void check_cnf_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_cnf_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 	const char *sdp = NULL;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -736,7 +812,7 @@ static void check_cnf_ind(struct mncc_connection *conn, const char *buf, int rc)
 
 	/* Forward SDP received from the other side */
 	other_leg = call_leg_other(&leg->base);
-	if (other_leg && *other_leg->rx_sdp && other_leg->rx_sdp_changed) {
+	if (other_leg && other_leg->rx_sdp && other_leg->rx_sdp_changed) {
 		sdp = other_leg->rx_sdp;
 		other_leg->rx_sdp_changed = false;
 	}
@@ -749,13 +825,12 @@ static void check_cnf_ind(struct mncc_connection *conn, const char *buf, int rc)
 	mncc_rtp_send(conn, MNCC_RTP_CREATE, data->callref, sdp);
 }
 
-static void check_alrt_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_alrt_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -763,6 +838,7 @@ static void check_alrt_ind(struct mncc_connection *conn, const char *buf, int rc
 
 	LOGP(DMNCC, LOGL_DEBUG,
 		"leg(%u) is alerting.\n", leg->callref);
+	call_stamp(leg->base.call, CALL_TS_RINGING);
 
 	other_leg = call_leg_other(&leg->base);
 	if (!other_leg) {
@@ -775,13 +851,12 @@ static void check_alrt_ind(struct mncc_connection *conn, const char *buf, int rc
 	other_leg->ring_call(other_leg);
 }
 
-static void check_hold_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_hold_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -797,15 +872,15 @@ static void check_hold_ind(struct mncc_connection *conn, const char *buf, int rc
 	other_leg->hold_call(other_leg);
 	mncc_send(leg->conn, MNCC_HOLD_CNF, leg->callref);
 	leg->state = MNCC_CC_HOLD;
+	call_ctr_inc(CALL_CTR_HOLD);
 }
 
-static void check_retrieve_ind(struct mncc_connection *conn, const char *buf, int rc)
+static void check_retrieve_ind(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -826,22 +901,23 @@ static void check_retrieve_ind(struct mncc_connection *conn, const char *buf, in
 	 * audio to the port of the original call
 	 */
 	leg->state = MNCC_CC_CONNECTED;
+	call_ctr_inc(CALL_CTR_RETRIEVE);
 	send_rtp_connect(leg, other_leg);
 }
 
-static void check_stp_cnf(struct mncc_connection *conn, const char *buf, int rc)
+static void check_stp_cnf(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
 	call_leg_rx_sdp(&leg->base, data->sdp);
 
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) setup completed\n", leg->callref);
+	call_stamp(leg->base.call, CALL_TS_ANSWER);
 
 	other_leg = call_leg_other(&leg->base);
 	if (!other_leg) {
@@ -855,18 +931,19 @@ static void check_stp_cnf(struct mncc_connection *conn, const char *buf, int rc)
 		return;
 	leg->state = MNCC_CC_CONNECTED;
 	mncc_send(leg->conn, MNCC_SETUP_COMPL_REQ, leg->callref);
+	call_connected(leg->base.call);
+	call_ctr_inc(CALL_CTR_MT_CONNECT);
 
 	other_leg->connect_call(other_leg);
 }
 
-static void check_dtmf_start(struct mncc_connection *conn, const char *buf, int rc)
+static void check_dtmf_start(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
 	struct gsm_mncc out_mncc = { 0, };
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 	struct call_leg *other_leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -877,20 +954,20 @@ static void check_dtmf_start(struct mncc_connection *conn, const char *buf, int
 	other_leg = call_leg_other(&leg->base);
 	if (other_leg && other_leg->dtmf)
 		other_leg->dtmf(other_leg, data->keypad);
+	call_ctr_inc(CALL_CTR_DTMF);
 
-	mncc_fill_header(&out_mncc, MNCC_START_DTMF_RSP, leg->callref);
+	mncc_fill_header(conn, &out_mncc, MNCC_START_DTMF_RSP, leg->callref);
 	out_mncc.fields |= MNCC_F_KEYPAD;
 	out_mncc.keypad = data->keypad;
 	mncc_write(conn, &out_mncc);
 }
 
-static void check_dtmf_stop(struct mncc_connection *conn, const char *buf, int rc)
+static void check_dtmf_stop(struct mncc_connection *conn, const struct gsm_mncc *data)
 {
 	struct gsm_mncc out_mncc = { 0, };
-	const struct gsm_mncc *data;
 	struct mncc_call_leg *leg;
 
-	leg = find_leg(conn, buf, rc, &data);
+	leg = find_leg(conn, data);
 	if (!leg)
 		return;
 
@@ -898,23 +975,14 @@ static void check_dtmf_stop(struct mncc_connection *conn, const char *buf, int r
 
 	LOGP(DMNCC, LOGL_DEBUG, "leg(%u) DTMF key=%c\n", leg->callref, data->keypad);
 
-	mncc_fill_header(&out_mncc, MNCC_STOP_DTMF_RSP, leg->callref);
+	mncc_fill_header(conn, &out_mncc, MNCC_STOP_DTMF_RSP, leg->callref);
 	out_mncc.fields |= MNCC_F_KEYPAD;
 	out_mncc.keypad = data->keypad;
 	mncc_write(conn, &out_mncc);
 }
 
-static void check_hello(struct mncc_connection *conn, const char *buf, int rc)
+static void check_hello(struct mncc_connection *conn, const struct gsm_mncc_hello *hello)
 {
-	const struct gsm_mncc_hello *hello;
-
-	if (rc != sizeof(*hello)) {
-		LOGP(DMNCC, LOGL_ERROR, "Hello shorter than expected %d vs. %zu\n",
-			rc, sizeof(*hello));
-		return close_connection(conn);
-	}
-
-	hello = (const struct gsm_mncc_hello *) buf;
 	LOGP(DMNCC, LOGL_NOTICE, "Got hello message version %d\n", hello->version);
 
 	if (hello->version != MNCC_SOCK_VERSION) {
@@ -933,18 +1001,16 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	struct msgb *msg;
 	int rc;
 
-	leg = talloc_zero(call, struct mncc_call_leg);
+	leg = call_mncc_leg_alloc(call);
 	if (!leg) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to allocate leg call(%u)\n",
 			call->id);
 		return -1;
 	}
 
-	leg->base.type = CALL_TYPE_MNCC;
 	leg->base.connect_call = mncc_call_leg_connect;
 	leg->base.ring_call = mncc_call_leg_ring;
 	leg->base.release_call = mncc_call_leg_release;
-	leg->base.call = call;
 	leg->base.update_rtp = update_rtp;
 
 	leg->callref = call->id;
@@ -992,7 +1058,7 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	 * started this call. This here will be the call->remote, always forwarding the SDP that came in on
 	 * call->initial. */
 	if (call->initial && call->initial->rx_sdp_changed) {
-		OSMO_STRLCPY_ARRAY(mncc.sdp, call->initial->rx_sdp);
+		mncc_set_sdp(mncc.sdp, sizeof(mncc.sdp), call->initial->rx_sdp, leg->callref);
 		call->initial->rx_sdp_changed = false;
 	}
 
@@ -1004,11 +1070,13 @@ int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call)
 	if (rc != sizeof(mncc)) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to send message leg(%u)\n",
 			leg->callref);
-		talloc_free(leg);
+		call_leg_free(&leg->base);
 		return -1;
 	}
 
 	call->remote = &leg->base;
+	call_mncc_leg_add(leg);
+	call_stamp(call, CALL_TS_INVITE);
 	return 0;
 }
 
@@ -1016,35 +1084,73 @@ static void mncc_reconnect(void *data)
 {
 	int rc;
 	struct mncc_connection *conn = data;
+	const char *path = conn->mux_path ? conn->mux_path : conn->path;
 
 	rc = osmo_sock_unix_init_ofd(&conn->fd, SOCK_SEQPACKET, 0,
-					conn->app->mncc.path, OSMO_SOCK_F_CONNECT);
+					path, OSMO_SOCK_F_CONNECT);
 	if (rc < 0) {
 		LOGP(DMNCC, LOGL_ERROR, "Failed to connect(%s). Retrying\n",
-			conn->app->mncc.path);
+			path);
 		conn->state = MNCC_DISCONNECTED;
 		conn->fd.fd = -1;
 		osmo_timer_schedule(&conn->reconnect, 5, 0);
 		return;
 	}
 
-	LOGP(DMNCC, LOGL_NOTICE, "Reconnected to %s\n", conn->app->mncc.path);
+	LOGP(DMNCC, LOGL_NOTICE, "Reconnected to %s\n", path);
 	conn->state = MNCC_WAIT_VERSION;
 }
 
-static inline void log_mncc(const char *label, const uint8_t *buf, size_t buflen)
-{
+/* Typed, read-only view of a received MNCC message */
+union mncc_msg {
 	uint32_t msg_type;
-	const struct gsm_mncc *gsm_mncc;
-	const struct gsm_mncc_rtp *gsm_mncc_rtp;
-	const char *sdp = NULL;
+	struct gsm_mncc signal;
+	struct gsm_mncc_rtp rtp;
+	struct gsm_mncc_hello hello;
+};
 
-	/* Any size errors will be logged elsewhere already, so just exit here if the buffer is too small. */
-	if (buflen < 4)
-		return;
-	memcpy(&msg_type, buf, 4);
+/* Receive buffer, aligned for the view and large enough for any message */
+union mncc_rx_buf {
+	union mncc_msg msg;
+	char data[4096];
+};
 
-	switch (msg_type) {
+/* The SDP of a received message, NULL if its type carries none */
+static const char *mncc_msg_sdp(const union mncc_msg *msg)
+{
+	switch (msg->msg_type) {
+	case MNCC_RTP_CREATE:
+	case MNCC_RTP_CONNECT:
+		return msg->rtp.sdp;
+	case MNCC_SOCKET_HELLO:
+		return NULL;
+	default:
+		return msg->signal.sdp;
+	}
+}
+
+/* Check the size of a received message for its type and that its SDP is nul
+ * terminated. Handlers then use the message in place, it stays valid until
+ * the next recv(); only what has to outlive it is copied out. */
+static bool mncc_rx_check(union mncc_msg *msg, int rc)
+{
+	char *sdp;
+	size_t size, sdp_size;
+
+	switch (msg->msg_type) {
+	case MNCC_SOCKET_HELLO:
+		if (rc != sizeof(msg->hello)) {
+			LOGP(DMNCC, LOGL_ERROR, "Hello shorter than expected %d vs. %zu\n",
+				rc, sizeof(msg->hello));
+			return false;
+		}
+		return true;
+	case MNCC_RTP_CREATE:
+	case MNCC_RTP_CONNECT:
+		size = sizeof(msg->rtp);
+		sdp = msg->rtp.sdp;
+		sdp_size = sizeof(msg->rtp.sdp);
+		break;
 	case MNCC_SETUP_IND:
 	case MNCC_DISC_IND:
 	case MNCC_REL_IND:
@@ -1056,106 +1162,147 @@ static inline void log_mncc(const char *label, const uint8_t *buf, size_t buflen
 	case MNCC_ALERT_IND:
 	case MNCC_HOLD_IND:
 	case MNCC_RETRIEVE_IND:
-		if (buflen < sizeof(gsm_mncc))
-			return;
-		gsm_mncc = (void *)buf;
-		sdp = gsm_mncc->sdp;
-		break;
-	case MNCC_RTP_CREATE:
-	case MNCC_RTP_CONNECT:
-		if (buflen < sizeof(gsm_mncc_rtp))
-			return;
-		gsm_mncc_rtp = (void *)buf;
-		sdp = gsm_mncc_rtp->sdp;
+	case MNCC_START_DTMF_IND:
+	case MNCC_STOP_DTMF_IND:
+		size = sizeof(msg->signal);
+		sdp = msg->signal.sdp;
+		sdp_size = sizeof(msg->signal.sdp);
 		break;
-
 	default:
-		break;
+		/* not handled, mncc_rx_msg() complains about it */
+		return true;
 	}
-	if (sdp)
-		LOGP(DMNCC, LOGL_DEBUG, "%sMNCC %s with SDP=%s\n", label, osmo_mncc_name(msg_type),
-		     osmo_quote_str(sdp, -1));
-	else
-		LOGP(DMNCC, LOGL_DEBUG, "%sMNCC %s\n", label, osmo_mncc_name(msg_type));
+
+	if (rc < size) {
+		LOGP(DMNCC, LOGL_ERROR, "%s of wrong size %d vs. %zu\n",
+			osmo_mncc_name(msg->msg_type), rc, size);
+		return false;
+	}
+
+	if (!memchr(sdp, '\0', sdp_size)) {
+		LOGP(DMNCC, LOGL_ERROR, "%s with unterminated SDP, ignoring the SDP\n",
+			osmo_mncc_name(msg->msg_type));
+		sdp[0] = '\0';
+	}
+	return true;
 }
 
-/* osmo-fd read call-back for MNCC socket: read MNCC message + dispatch it */
-static int mncc_data(struct osmo_fd *fd, unsigned int what)
+/* Dispatch one MNCC message received on the socket */
+static void mncc_rx_msg(struct mncc_connection *conn, union mncc_msg *msg, int rc)
 {
-	char buf[4096];
-	uint32_t msg_type;
-	int rc;
-	struct mncc_connection *conn = fd->data;
+	const char *sdp;
 
-	rc = read(fd->fd, buf, sizeof(buf));
-	if (rc <= 0) {
-		LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
-			rc, strerror(errno));
-		goto bad_data;
-	}
-	if (rc <= 4) {
-		LOGP(DMNCC, LOGL_ERROR, "Data too short with: %d\n", rc);
-		goto bad_data;
-	}
+	if (!mncc_rx_check(msg, rc))
+		return close_connection(conn);
 
-	log_mncc("rx ", (void *)buf, rc);
+	sdp = mncc_msg_sdp(msg);
+	if (sdp)
+		LOGP_HOT(DMNCC, "rx MNCC %s with SDP=%s\n", osmo_mncc_name(msg->msg_type),
+			 osmo_quote_str(sdp, -1));
+	else
+		LOGP_HOT(DMNCC, "rx MNCC %s\n", osmo_mncc_name(msg->msg_type));
 
 	/* Handle the received MNCC message */
-	memcpy(&msg_type, buf, 4);
-	switch (msg_type) {
+	switch (msg->msg_type) {
 	case MNCC_SOCKET_HELLO:
-		check_hello(conn, buf, rc);
+		check_hello(conn, &msg->hello);
 		break;
 	case MNCC_SETUP_IND:
-		check_setup(conn, buf, rc);
+		check_setup(conn, &msg->signal);
 		break;
 	case MNCC_RTP_CREATE:
-		check_rtp_create(conn, buf, rc);
+		check_rtp_create(conn, &msg->rtp);
 		break;
 	case MNCC_RTP_CONNECT:
-		check_rtp_connect(conn, buf, rc);
+		check_rtp_connect(conn, &msg->rtp);
 		break;
 	case MNCC_DISC_IND:
-		check_disc_ind(conn, buf, rc);
+		check_disc_ind(conn, &msg->signal);
 		break;
 	case MNCC_REL_IND:
-		check_rel_ind(conn, buf, rc);
+		check_rel_ind(conn, &msg->signal);
 		break;
 	case MNCC_REJ_IND:
-		check_rej_ind(conn, buf, rc);
+		check_rej_ind(conn, &msg->signal);
 		break;
 	case MNCC_REL_CNF:
-		check_rel_cnf(conn, buf, rc);
+		check_rel_cnf(conn, &msg->signal);
 		break;
 	case MNCC_SETUP_COMPL_IND:
-		check_stp_cmpl_ind(conn, buf, rc);
+		check_stp_cmpl_ind(conn, &msg->signal);
 		break;
 	case MNCC_SETUP_CNF:
-		check_stp_cnf(conn, buf, rc);
+		check_stp_cnf(conn, &msg->signal);
 		break;
 	case MNCC_CALL_CONF_IND:
-		check_cnf_ind(conn, buf, rc);
+		check_cnf_ind(conn, &msg->signal);
 		break;
 	case MNCC_ALERT_IND:
-		check_alrt_ind(conn, buf, rc);
+		check_alrt_ind(conn, &msg->signal);
 		break;
 	case MNCC_HOLD_IND:
-		check_hold_ind(conn, buf, rc);
+		check_hold_ind(conn, &msg->signal);
 		break;
 	case MNCC_RETRIEVE_IND:
-		check_retrieve_ind(conn, buf, rc);
+		check_retrieve_ind(conn, &msg->signal);
 		break;
 	case MNCC_START_DTMF_IND:
-		check_dtmf_start(conn, buf, rc);
+		check_dtmf_start(conn, &msg->signal);
 		break;
 	case MNCC_STOP_DTMF_IND:
-		check_dtmf_stop(conn, buf, rc);
+		check_dtmf_stop(conn, &msg->signal);
 		break;
 	default:
 		LOGP(DMNCC, LOGL_ERROR, "Unhandled message type %d/0x%x\n",
-			msg_type, msg_type);
+			msg->msg_type, msg->msg_type);
 		break;
 	}
+}
+
+/* osmo-fd call-back for MNCC socket: flush the tx queue, read MNCC messages +
+ * dispatch them. Up to read_budget messages are handled per wakeup before we
+ * give the other parts of the event loop a chance to run again. */
+static int mncc_data(struct osmo_fd *fd, unsigned int what)
+{
+	union mncc_rx_buf buf;
+	int rc, i;
+	uint32_t msg_type;
+	struct timespec start;
+	struct mncc_connection *conn = fd->data;
+	int budget = OSMO_MAX(conn->app->mncc.read_budget, 1);
+
+	if (what & OSMO_FD_WRITE) {
+		mncc_flush(conn);
+		if (conn->fd.fd < 0)
+			return 0;
+	}
+
+	if (!(what & OSMO_FD_READ))
+		return 0;
+
+	for (i = 0; i < budget; ++i) {
+		rc = recv(fd->fd, buf.data, sizeof(buf.data), MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 0) {
+			LOGP(DMNCC, LOGL_ERROR, "Failed to read %d/%s. Re-connecting.\n",
+				rc, strerror(errno));
+			goto bad_data;
+		}
+		if (rc <= 4) {
+			LOGP(DMNCC, LOGL_ERROR, "Data too short with: %d\n", rc);
+			goto bad_data;
+		}
+
+		latency_start(&start);
+		msg_type = buf.msg.msg_type;
+		mncc_rx_msg(conn, &buf.msg, rc);
+		latency_record(LATENCY_MNCC, msg_type, &start);
+
+		/* the handler might have closed the connection */
+		if (conn->fd.fd < 0)
+			break;
+	}
 	return 0;
 
 bad_data:
@@ -1163,15 +1310,23 @@ bad_data:
 	return 0;
 }
 
+static void close_timeout(void *data)
+{
+	close_connection(data);
+}
+
 void mncc_connection_init(struct mncc_connection *conn, struct app_config *cfg)
 {
 	conn->reconnect.cb = mncc_reconnect;
 	conn->reconnect.data = conn;
+	conn->close_timer.cb = close_timeout;
+	conn->close_timer.data = conn;
 	conn->fd.cb = mncc_data;
 	conn->fd.data = conn;
 	conn->fd.fd = -1;
 	conn->app = cfg;
 	conn->state = MNCC_DISCONNECTED;
+	INIT_LLIST_HEAD(&conn->tx_queue);
 }
 
 void mncc_connection_start(struct mncc_connection *conn)
@@ -1180,6 +1335,13 @@ void mncc_connection_start(struct mncc_connection *conn)
 	osmo_timer_schedule(&conn->reconnect, 0, 0);
 }
 
+/* Close the connection for good, the calls through it are released */
+void mncc_connection_stop(struct mncc_connection *conn)
+{
+	close_connection(conn);
+	osmo_timer_del(&conn->reconnect);
+}
+
 const struct value_string mncc_conn_state_vals[] = {
 	{ MNCC_DISCONNECTED,	"DISCONNECTED"	},
 	{ MNCC_WAIT_VERSION,	"WAITING"	},
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <osmocom/core/linuxlist.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/timer.h>
 #include <osmocom/core/utils.h>
@@ -16,11 +17,23 @@ enum {
 };
 
 struct mncc_connection {
+	/* entry in app_config.mncc.conns */
+	struct llist_head entry;
+	const char *path;
+	/* in a worker the supervisor's socket connected to instead of path */
+	const char *mux_path;
+
 	int state;
 	struct app_config *app;
 	struct osmo_fd fd;
 
 	struct osmo_timer_list reconnect;
+	/* closes the connection outside of the call handlers, see mncc_queue() */
+	struct osmo_timer_list close_timer;
+
+	/* messages waiting for the socket to become writable */
+	struct llist_head tx_queue;
+	unsigned int tx_queue_len;
 
 	uint32_t last_callref;
 
@@ -30,6 +43,7 @@ struct mncc_connection {
 
 void mncc_connection_init(struct mncc_connection *conn, struct app_config *cfg);
 void mncc_connection_start(struct mncc_connection *conn);
+void mncc_connection_stop(struct mncc_connection *conn);
 
 int mncc_create_remote_leg(struct mncc_connection *conn, struct call *call);
 
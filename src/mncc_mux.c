@@ -0,0 +1,568 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mncc_mux.h"
+#include "mncc_protocol.h"
+#include "logging.h"
+
+#include <osmocom/core/hashtable.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/socket.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Like the MNCC connection, bounded so a stuck peer is noticed */
+#define MUX_TX_QUEUE_MAX	4096
+
+/* Messages waiting for a socket to become writable */
+struct mux_queue {
+	struct llist_head msgs;
+	unsigned int len;
+	/* overflowed, the peer is closed by mux_cleanup() */
+	bool failed;
+};
+
+/* One worker connected to the multiplexer */
+struct mux_client {
+	struct llist_head entry;
+	struct mncc_mux *mux;
+	struct osmo_fd fd;
+	struct mux_queue tx;
+	/* got the hello of the MSC */
+	bool ready;
+};
+
+/* Which worker a callref belongs to */
+struct mux_call {
+	struct hlist_node entry;
+	uint32_t callref;
+	struct mux_client *client;
+	/* answered, it is no longer rejected but released */
+	bool connected;
+};
+
+struct mncc_mux {
+	struct llist_head entry;
+	const char *msc_path;
+	const char *path;
+
+	struct osmo_fd msc_fd;
+	struct mux_queue msc_tx;
+	struct osmo_timer_list reconnect;
+	/* closes peers with an overflowed queue outside of the handlers */
+	struct osmo_timer_list cleanup;
+	/* replayed to workers that connect later */
+	bool have_hello;
+	struct gsm_mncc_hello hello;
+
+	struct osmo_fd listen_fd;
+	/* struct mux_client, new calls go to the first ready one, which then moves to the end */
+	struct llist_head clients;
+	DECLARE_HASHTABLE(calls, 10);
+};
+
+/* Header common to all MNCC messages except the hello */
+struct mux_hdr {
+	uint32_t msg_type;
+	uint32_t callref;
+};
+
+union mux_buf {
+	struct mux_hdr hdr;
+	struct gsm_mncc_hello hello;
+	char data[4096];
+};
+
+static LLIST_HEAD(muxes);
+
+char *mncc_mux_path(void *ctx, const char *msc_path)
+{
+	return talloc_asprintf(ctx, "%s.mux", msc_path);
+}
+
+static struct mux_call *mux_call_find(struct mncc_mux *mux, uint32_t callref)
+{
+	struct mux_call *call;
+
+	hash_for_each_possible(mux->calls, call, entry, callref) {
+		if (call->callref == callref)
+			return call;
+	}
+	return NULL;
+}
+
+static struct mux_call *mux_call_set(struct mncc_mux *mux, uint32_t callref, struct mux_client *client)
+{
+	struct mux_call *call = mux_call_find(mux, callref);
+
+	if (!call) {
+		call = talloc_zero(mux, struct mux_call);
+		call->callref = callref;
+		hash_add(mux->calls, &call->entry, callref);
+	}
+	call->client = client;
+	return call;
+}
+
+static void mux_call_del(struct mux_call *call)
+{
+	hash_del(&call->entry);
+	talloc_free(call);
+}
+
+static void mux_cause(struct gsm_mncc *mncc, int cause)
+{
+	mncc->fields |= MNCC_F_CAUSE;
+	mncc->cause.coding = GSM48_CAUSE_CODING_GSM;
+	mncc->cause.location = GSM48_CAUSE_LOC_PUN_S_LU;
+	mncc->cause.value = cause;
+}
+
+static void mux_queue_init(struct mux_queue *tx)
+{
+	INIT_LLIST_HEAD(&tx->msgs);
+	tx->len = 0;
+	tx->failed = false;
+}
+
+static void mux_queue_clear(struct mux_queue *tx)
+{
+	struct msgb *msg;
+
+	while ((msg = msgb_dequeue(&tx->msgs)))
+		msgb_free(msg);
+	mux_queue_init(tx);
+}
+
+/*
+ * Queue a message for the MSC or a worker, it is sent once the socket is
+ * writable. A peer that does not keep up is closed from a timer, the
+ * callers are message handlers that still use it.
+ */
+static void mux_send(struct mncc_mux *mux, struct osmo_fd *fd, struct mux_queue *tx,
+		     const void *data, size_t len, const char *peer)
+{
+	struct msgb *msg = NULL;
+
+	if (fd->fd < 0 || tx->failed)
+		return;
+
+	if (tx->len < MUX_TX_QUEUE_MAX)
+		msg = msgb_alloc(len, "MNCC mux tx");
+	if (!msg) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: tx queue to %s full at %s, closing it\n",
+			peer, osmo_mncc_name(((const struct mux_hdr *) data)->msg_type));
+		tx->failed = true;
+		osmo_timer_schedule(&mux->cleanup, 0, 0);
+		return;
+	}
+
+	memcpy(msgb_put(msg, len), data, len);
+	msgb_enqueue(&tx->msgs, msg);
+	tx->len += 1;
+	osmo_fd_write_enable(fd);
+}
+
+static void msc_send(struct mncc_mux *mux, const void *data, size_t len)
+{
+	mux_send(mux, &mux->msc_fd, &mux->msc_tx, data, len, mux->msc_path);
+}
+
+static void client_send(struct mux_client *client, const void *data, size_t len)
+{
+	mux_send(client->mux, &client->fd, &client->tx, data, len, "worker");
+}
+
+/* Write what the socket takes without blocking, -1 if the peer is gone */
+static int mux_flush(struct osmo_fd *fd, struct mux_queue *tx)
+{
+	struct msgb *msg;
+	int rc;
+
+	while (!llist_empty(&tx->msgs)) {
+		msg = llist_first_entry(&tx->msgs, struct msgb, list);
+		rc = send(fd->fd, msg->data, msg->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rc != msg->len) {
+			LOGP(DMNCC, LOGL_ERROR, "mux: failed to send %u queued messages: %s\n",
+				tx->len, rc < 0 ? strerror(errno) : "short write");
+			return -1;
+		}
+
+		llist_del(&msg->list);
+		msgb_free(msg);
+		tx->len -= 1;
+	}
+
+	osmo_fd_write_disable(fd);
+	return 0;
+}
+
+static void close_fd(struct osmo_fd *fd)
+{
+	if (fd->fd < 0)
+		return;
+	osmo_fd_unregister(fd);
+	close(fd->fd);
+	fd->fd = -1;
+}
+
+/* Release a call on the MSC whose worker is gone */
+static void msc_release(struct mncc_mux *mux, struct mux_call *call)
+{
+	struct gsm_mncc rel = {
+		.msg_type = call->connected ? MNCC_REL_REQ : MNCC_REJ_REQ,
+		.callref = call->callref,
+	};
+
+	LOGP(DMNCC, LOGL_NOTICE, "mux: worker of call(%u) is gone, sending %s\n",
+		call->callref, osmo_mncc_name(rel.msg_type));
+	mux_cause(&rel, GSM48_CC_CAUSE_TEMP_FAILURE);
+	msc_send(mux, &rel, sizeof(rel));
+}
+
+static void client_close(struct mux_client *client)
+{
+	struct mncc_mux *mux = client->mux;
+	struct mux_call *call;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(mux->calls, bkt, tmp, call, entry) {
+		if (call->client != client)
+			continue;
+		msc_release(mux, call);
+		mux_call_del(call);
+	}
+
+	close_fd(&client->fd);
+	mux_queue_clear(&client->tx);
+	llist_del(&client->entry);
+	talloc_free(client);
+}
+
+static void client_hello(struct mux_client *client)
+{
+	struct mncc_mux *mux = client->mux;
+
+	client_send(client, &mux->hello, sizeof(mux->hello));
+	client->ready = true;
+}
+
+/* A new call from the MSC, hand it to the next worker in turn */
+static struct mux_client *client_next(struct mncc_mux *mux)
+{
+	struct mux_client *client;
+
+	llist_for_each_entry(client, &mux->clients, entry) {
+		if (!client->ready)
+			continue;
+		llist_move_tail(&client->entry, &mux->clients);
+		return client;
+	}
+	return NULL;
+}
+
+/* The last message of a call in either direction */
+static bool msg_ends_call(uint32_t msg_type)
+{
+	switch (msg_type) {
+	case MNCC_REL_IND:
+	case MNCC_REL_CNF:
+	case MNCC_REJ_IND:
+	case MNCC_REJ_REQ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void msc_close(struct mncc_mux *mux)
+{
+	struct mux_client *client, *tmp;
+
+	LOGP(DMNCC, LOGL_ERROR, "mux: lost %s, disconnecting the workers\n", mux->msc_path);
+	close_fd(&mux->msc_fd);
+	mux_queue_clear(&mux->msc_tx);
+	mux->have_hello = false;
+
+	/* the workers release their calls and connect again */
+	llist_for_each_entry_safe(client, tmp, &mux->clients, entry)
+		client_close(client);
+	osmo_timer_schedule(&mux->reconnect, 5, 0);
+}
+
+static void mux_cleanup(void *data)
+{
+	struct mncc_mux *mux = data;
+	struct mux_client *client, *tmp;
+
+	/* this takes the workers along */
+	if (mux->msc_tx.failed) {
+		msc_close(mux);
+		return;
+	}
+
+	llist_for_each_entry_safe(client, tmp, &mux->clients, entry) {
+		if (client->tx.failed)
+			client_close(client);
+	}
+}
+
+static void msc_rx(struct mncc_mux *mux, const union mux_buf *buf, int len)
+{
+	struct mux_client *client;
+	struct mux_call *call;
+
+	if (buf->hdr.msg_type == MNCC_SOCKET_HELLO) {
+		if (len != sizeof(buf->hello)) {
+			LOGP(DMNCC, LOGL_ERROR, "mux: hello of wrong size %d\n", len);
+			return;
+		}
+		memcpy(&mux->hello, &buf->hello, sizeof(mux->hello));
+		mux->have_hello = true;
+		llist_for_each_entry(client, &mux->clients, entry)
+			client_hello(client);
+		return;
+	}
+
+	if (len < sizeof(buf->hdr)) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: message too short %d\n", len);
+		return;
+	}
+
+	call = mux_call_find(mux, buf->hdr.callref);
+	if (!call && buf->hdr.msg_type == MNCC_SETUP_IND) {
+		client = client_next(mux);
+		if (!client) {
+			struct gsm_mncc rej = {
+				.msg_type = MNCC_REJ_REQ,
+				.callref = buf->hdr.callref,
+			};
+
+			LOGP(DMNCC, LOGL_ERROR, "mux: no worker for call(%u)\n", buf->hdr.callref);
+			mux_cause(&rej, GSM48_CC_CAUSE_TEMP_FAILURE);
+			msc_send(mux, &rej, sizeof(rej));
+			return;
+		}
+		call = mux_call_set(mux, buf->hdr.callref, client);
+	}
+
+	if (!call) {
+		LOGP(DMNCC, LOGL_NOTICE, "mux: %s for unknown call(%u)\n",
+			osmo_mncc_name(buf->hdr.msg_type), buf->hdr.callref);
+		return;
+	}
+
+	if (buf->hdr.msg_type == MNCC_SETUP_CNF)
+		call->connected = true;
+	client_send(call->client, buf->data, len);
+	if (msg_ends_call(buf->hdr.msg_type))
+		mux_call_del(call);
+}
+
+static int msc_data(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_mux *mux = fd->data;
+	union mux_buf buf;
+	int rc;
+
+	if ((what & OSMO_FD_WRITE) && mux_flush(fd, &mux->msc_tx) < 0) {
+		msc_close(mux);
+		return 0;
+	}
+	if (!(what & OSMO_FD_READ))
+		return 0;
+
+	rc = recv(fd->fd, buf.data, sizeof(buf.data), 0);
+	if (rc <= 0) {
+		msc_close(mux);
+		return 0;
+	}
+
+	msc_rx(mux, &buf, rc);
+	return 0;
+}
+
+static void msc_reconnect(void *data)
+{
+	struct mncc_mux *mux = data;
+	int rc;
+
+	rc = osmo_sock_unix_init_ofd(&mux->msc_fd, SOCK_SEQPACKET, 0,
+					mux->msc_path, OSMO_SOCK_F_CONNECT);
+	if (rc < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: failed to connect(%s). Retrying\n", mux->msc_path);
+		mux->msc_fd.fd = -1;
+		osmo_timer_schedule(&mux->reconnect, 5, 0);
+		return;
+	}
+
+	LOGP(DMNCC, LOGL_NOTICE, "mux: connected to %s\n", mux->msc_path);
+}
+
+static int client_data(struct osmo_fd *fd, unsigned int what)
+{
+	struct mux_client *client = fd->data;
+	struct mncc_mux *mux = client->mux;
+	struct mux_call *call;
+	union mux_buf buf;
+	int rc;
+
+	if ((what & OSMO_FD_WRITE) && mux_flush(fd, &client->tx) < 0) {
+		client_close(client);
+		return 0;
+	}
+	if (!(what & OSMO_FD_READ))
+		return 0;
+
+	rc = recv(fd->fd, buf.data, sizeof(buf.data), 0);
+	if (rc <= 0) {
+		LOGP(DMNCC, LOGL_NOTICE, "mux: worker disconnected from %s\n", mux->path);
+		client_close(client);
+		return 0;
+	}
+	if (rc < sizeof(buf.hdr)) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: message too short %d\n", rc);
+		return 0;
+	}
+
+	/* the callref of a call to the MS is chosen by the worker */
+	if (buf.hdr.msg_type == MNCC_SETUP_REQ) {
+		if (mux_call_find(mux, buf.hdr.callref)) {
+			struct gsm_mncc rej = {
+				.msg_type = MNCC_REJ_IND,
+				.callref = buf.hdr.callref,
+			};
+
+			LOGP(DMNCC, LOGL_ERROR, "mux: callref(%u) of a new call is in use\n",
+				buf.hdr.callref);
+			mux_cause(&rej, GSM48_CC_CAUSE_TEMP_FAILURE);
+			client_send(client, &rej, sizeof(rej));
+			return 0;
+		}
+		mux_call_set(mux, buf.hdr.callref, client);
+	}
+
+	msc_send(mux, buf.data, rc);
+
+	call = mux_call_find(mux, buf.hdr.callref);
+	if (!call)
+		return 0;
+	if (buf.hdr.msg_type == MNCC_SETUP_RSP)
+		call->connected = true;
+	if (msg_ends_call(buf.hdr.msg_type))
+		mux_call_del(call);
+	return 0;
+}
+
+static int client_accept(struct osmo_fd *fd, unsigned int what)
+{
+	struct mncc_mux *mux = fd->data;
+	struct mux_client *client;
+	int sfd;
+
+	sfd = accept(fd->fd, NULL, NULL);
+	if (sfd < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: failed to accept: %s\n", strerror(errno));
+		return 0;
+	}
+
+	client = talloc_zero(mux, struct mux_client);
+	client->mux = mux;
+	mux_queue_init(&client->tx);
+	osmo_fd_setup(&client->fd, sfd, OSMO_FD_READ, client_data, client, 0);
+	if (osmo_fd_register(&client->fd) < 0) {
+		close(sfd);
+		talloc_free(client);
+		return 0;
+	}
+	llist_add_tail(&client->entry, &mux->clients);
+
+	LOGP(DMNCC, LOGL_NOTICE, "mux: worker connected to %s\n", mux->path);
+	if (mux->have_hello)
+		client_hello(client);
+	return 0;
+}
+
+struct mncc_mux *mncc_mux_start(void *ctx, const char *msc_path)
+{
+	struct mncc_mux *mux;
+	int rc;
+
+	mux = talloc_zero(ctx, struct mncc_mux);
+	mux->msc_path = talloc_strdup(mux, msc_path);
+	mux->path = mncc_mux_path(mux, msc_path);
+	INIT_LLIST_HEAD(&mux->clients);
+	hash_init(mux->calls);
+	mux->msc_fd.fd = -1;
+	mux->msc_fd.cb = msc_data;
+	mux->msc_fd.data = mux;
+	mux_queue_init(&mux->msc_tx);
+	osmo_timer_setup(&mux->reconnect, msc_reconnect, mux);
+	osmo_timer_setup(&mux->cleanup, mux_cleanup, mux);
+
+	/* a stale socket of an earlier run */
+	unlink(mux->path);
+	mux->listen_fd.cb = client_accept;
+	mux->listen_fd.data = mux;
+	rc = osmo_sock_unix_init_ofd(&mux->listen_fd, SOCK_SEQPACKET, 0,
+					mux->path, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		LOGP(DMNCC, LOGL_ERROR, "mux: failed to listen on %s\n", mux->path);
+		talloc_free(mux);
+		return NULL;
+	}
+
+	llist_add_tail(&mux->entry, &muxes);
+	msc_reconnect(mux);
+	return mux;
+}
+
+/* Close all sockets and timers, in a worker after the fork */
+void mncc_mux_stop_all(void)
+{
+	struct mncc_mux *mux, *tmp;
+	struct mux_client *client, *ctmp;
+
+	llist_for_each_entry_safe(mux, tmp, &muxes, entry) {
+		osmo_timer_del(&mux->reconnect);
+		osmo_timer_del(&mux->cleanup);
+		close_fd(&mux->msc_fd);
+		mux_queue_clear(&mux->msc_tx);
+		close_fd(&mux->listen_fd);
+		llist_for_each_entry_safe(client, ctmp, &mux->clients, entry) {
+			close_fd(&client->fd);
+			mux_queue_clear(&client->tx);
+		}
+		llist_del(&mux->entry);
+		talloc_free(mux);
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Shares the MNCC connection to one MSC between the worker processes. The
+ * supervisor connects to the MSC and offers a socket of its own that the
+ * workers connect to instead. MNCC_SETUP_IND of new calls from the MSC are
+ * spread over the workers, every other message follows its callref.
+ */
+struct mncc_mux;
+
+char *mncc_mux_path(void *ctx, const char *msc_path);
+struct mncc_mux *mncc_mux_start(void *ctx, const char *msc_path);
+void mncc_mux_stop_all(void);
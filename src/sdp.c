@@ -33,77 +33,104 @@
 #include <string.h>
 
 #include <osmocom/core/socket.h>
+#include <osmocom/core/utils.h>
 
-/*
- * Check if the media mode attribute exists in SDP, in this
- * case update the passed pointer with the media mode
- */
-bool sdp_get_sdp_mode(const sip_t *sip, sdp_mode_t *mode) {
-
-	const char *sdp_data;
-	sdp_parser_t *parser;
-	sdp_session_t *sdp;
+static bool sdp_parse_data(struct sdp_parsed *sdp, const char *data, size_t len, int flags)
+{
+	memset(sdp, 0, sizeof(*sdp));
+	sdp->data = data;
+	sdp->len = len;
 
-	if (!sip->sip_payload || !sip->sip_payload->pl_data) {
-		LOGP(DSIP, LOGL_ERROR, "No SDP file\n");
+	sdp->parser = sdp_parse(NULL, data, len, flags);
+	if (!sdp->parser) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to parse SDP\n");
 		return false;
 	}
 
-	sdp_data = sip->sip_payload->pl_data;
-	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), sdp_f_mode_0000);
-	if (!parser) {
-		LOGP(DSIP, LOGL_ERROR, "Failed to parse SDP\n");
+	sdp->session = sdp_session(sdp->parser);
+	if (!sdp->session) {
+		LOGP(DSIP, LOGL_ERROR, "No sdp session\n");
 		return false;
 	}
 
-	sdp = sdp_session(parser);
-	if (!sdp) {
-		LOGP(DSIP, LOGL_ERROR, "No sdp session\n");
-		sdp_parser_free(parser);
+	return true;
+}
+
+/*
+ * Parse the SDP of a SIP message once, so that screening, mode detection and
+ * address extraction can share the result. The parsed SDP needs to be
+ * released with sdp_parsed_free() even if parsing failed.
+ */
+bool sdp_parse_sip(struct sdp_parsed *sdp, const sip_t *sip)
+{
+	if (!sip || !sip->sip_payload || !sip->sip_payload->pl_data) {
+		memset(sdp, 0, sizeof(*sdp));
 		return false;
 	}
 
-	if (!sdp->sdp_media || !sdp->sdp_media->m_mode) {
-		sdp_parser_free(parser);
+	/* an error page or the like is no SDP to complain about */
+	if (sip->sip_content_type && sip->sip_content_type->c_type
+	    && strcasecmp(sip->sip_content_type->c_type, "application/sdp") != 0) {
+		memset(sdp, 0, sizeof(*sdp));
 		return false;
 	}
 
-	*mode = sdp->sdp_media->m_mode;
-	sdp_parser_free(parser);
-	return true;
+	return sdp_parse_data(sdp, sip->sip_payload->pl_data, sip->sip_payload->pl_len, 0);
+}
+
+void sdp_parsed_free(struct sdp_parsed *sdp)
+{
+	if (sdp->parser)
+		sdp_parser_free(sdp->parser);
+	memset(sdp, 0, sizeof(*sdp));
 }
 
 /*
- * We want to decide on the audio codec later but we need to see
- * if it is even including some of the supported ones.
+ * Check if the media mode attribute exists in SDP, in this
+ * case update the passed pointer with the media mode
  */
-bool sdp_screen_sdp(const sip_t *sip)
-{
-	const char *sdp_data;
-	sdp_parser_t *parser;
-	sdp_session_t *sdp;
-	sdp_media_t *media;
+bool sdp_get_sdp_mode(const struct sdp_parsed *sdp, sdp_mode_t *mode) {
+
+	struct sdp_parsed hold;
+	bool rc = false;
 
-	if (!sip->sip_payload || !sip->sip_payload->pl_data) {
+	if (!sdp->session) {
 		LOGP(DSIP, LOGL_ERROR, "No SDP file\n");
 		return false;
 	}
 
-	sdp_data = sip->sip_payload->pl_data;
-	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), 0);
-	if (!parser) {
-		LOGP(DSIP, LOGL_ERROR, "Failed to parse SDP\n");
-		return false;
+	/*
+	 * c=0.0.0.0 means hold, which only sdp_f_mode_0000 reflects in the
+	 * mode. The shared parse is without it, like for screening and
+	 * extraction, so parse once more. This is only done for re-INVITEs.
+	 */
+	if (!sdp_parse_data(&hold, sdp->data, sdp->len, sdp_f_mode_0000))
+		goto out;
+
+	if (hold.session->sdp_media && hold.session->sdp_media->m_mode) {
+		*mode = hold.session->sdp_media->m_mode;
+		rc = true;
 	}
 
-	sdp = sdp_session(parser);
-	if (!sdp) {
-		LOGP(DSIP, LOGL_ERROR, "No sdp session\n");
-		sdp_parser_free(parser);
+out:
+	sdp_parsed_free(&hold);
+	return rc;
+}
+
+/*
+ * We want to decide on the audio codec later but we need to see
+ * if it is even including some of the supported ones.
+ */
+bool sdp_screen_sdp(const struct sdp_parsed *sdp)
+{
+	sdp_media_t *media;
+
+	if (!sdp->session) {
+		LOGP(DSIP, LOGL_ERROR, "No SDP file\n");
 		return false;
 	}
 
-	for (media = sdp->sdp_media; media; media = media->m_next) {
+	for (media = sdp->session->sdp_media; media; media = media->m_next) {
 		sdp_rtpmap_t *map;
 
 		if (media->m_proto != sdp_proto_rtp)
@@ -113,57 +140,36 @@ bool sdp_screen_sdp(const sip_t *sip)
 
 		for (map = media->m_rtpmaps; map; map = map->rm_next) {
 			if (strcasecmp(map->rm_encoding, "GSM") == 0)
-				goto success;
+				return true;
 			if (strcasecmp(map->rm_encoding, "GSM-EFR") == 0)
-				goto success;
+				return true;
 			if (strcasecmp(map->rm_encoding, "GSM-HR-08") == 0)
-				goto success;
+				return true;
 			if (strcasecmp(map->rm_encoding, "AMR") == 0)
-				goto success;
+				return true;
 		}
 	}
 
-	sdp_parser_free(parser);
 	/* FIXME: osmo-sip-connector should not interfere in codecs at all */
 	return false;
-
-success:
-	sdp_parser_free(parser);
-	return true;
 }
 
 /* Extract RTP address, port and payload type from SDP received in SIP message, in order to populate the legacy MNCC
  * fields, for backwards compatibility. osmo-sip-connector now always sends the entire SDP info unchanged via MNCC,
  * which obsoletes the legacy fields. But for backwards compatibility, still populate the legacy fields. */
-bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
+bool sdp_extract_sdp(struct sip_call_leg *leg, const struct sdp_parsed *parsed, bool any_codec)
 {
 	sdp_connection_t *conn;
 	sdp_session_t *sdp;
-	sdp_parser_t *parser;
 	sdp_media_t *media;
-	const char *sdp_data;
 	uint16_t port;
 	bool found_conn = false, found_map = false;
 
-	if (!sip->sip_payload || !sip->sip_payload->pl_data) {
+	if (!parsed->session) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) but no SDP file\n", leg);
 		return false;
 	}
-
-	sdp_data = sip->sip_payload->pl_data;
-	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), 0);
-	if (!parser) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed to parse SDP\n",
-			leg);
-		return false;
-	}
-
-	sdp = sdp_session(parser);
-	if (!sdp) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) no sdp session\n", leg);
-		sdp_parser_free(parser);
-		return false;
-	}
+	sdp = parsed->session;
 
 	for (conn = sdp->sdp_connection; conn; conn = conn->c_next) {
 		switch (conn->c_addrtype) {
@@ -213,7 +219,6 @@ bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
 	if (!found_conn || !found_map) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) did not find %d/%d\n",
 			leg, found_conn, found_map);
-		sdp_parser_free(parser);
 		/* FIXME: osmo-sip-connector should not interfere in codecs at all */
 		return false;
 	}
@@ -229,10 +234,74 @@ bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
 		OSMO_ASSERT(0);
 	}
 
-	sdp_parser_free(parser);
 	return true;
 }
 
+static const char *sdp_mode_name(sdp_mode_t mode)
+{
+	switch (mode) {
+	case sdp_inactive:
+		return "inactive";
+	case sdp_sendrecv:
+		return "sendrecv";
+	case sdp_sendonly:
+		return "sendonly";
+	case sdp_recvonly:
+		return "recvonly";
+	default:
+		OSMO_ASSERT(false);
+		return NULL;
+	}
+}
+
+/* All four direction attributes have the same length, so they can be patched in place. */
+#define SDP_MODE_NAME_LEN	8
+
+static bool sdp_is_mode_attribute(const char *value)
+{
+	static const char * const names[] = { "inactive", "sendrecv", "sendonly", "recvonly" };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(names); ++i) {
+		if (strncasecmp(value, names[i], SDP_MODE_NAME_LEN) != 0)
+			continue;
+		switch (value[SDP_MODE_NAME_LEN]) {
+		case '\r':
+		case '\n':
+		case '\0':
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Cheap line scan of an SDP with a single media description. On success, 'attr' points at the value of the only
+ * direction attribute, or is NULL if there is none. Return false if the SDP needs a full parse and recomposition. */
+static bool sdp_scan_mode(const char *sdp_data, const char **attr)
+{
+	const char *line, *next;
+	int media = 0;
+
+	*attr = NULL;
+	for (line = sdp_data; *line; line = next) {
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+
+		if (strncmp(line, "m=", 2) == 0) {
+			if (++media > 1)
+				return false;
+			continue;
+		}
+		if (strncmp(line, "a=", 2) != 0 || !sdp_is_mode_attribute(line + 2))
+			continue;
+		if (*attr)
+			return false;
+		*attr = line + 2;
+	}
+
+	return media == 1;
+}
+
 /* One leg has sent a SIP or MNCC message, which is now translated/forwarded to the counterpart MNCC or SIP.
  * Take as much from the source's SDP as possible, but make sure the connection mode reflects the 'mode' arg (sendrecv,
  * recvonly, sendonly, inactive).
@@ -240,26 +309,26 @@ bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec)
  * SIP side that should receive this SDP in the SIP Invite that is being composed by the caller of this function.
  * \param leg  The target for which the returned SDP is intended.
  * \param other  The source of which we are to reflect the SDP.
- * \return  SDP string, using 'leg' as talloc ctx.
+ * \return  SDP string, using 'other' as talloc ctx.
  */
-char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode_t mode)
+static char *sdp_render(struct sip_call_leg *leg, struct call_leg *other, sdp_mode_t mode)
 {
-	sdp_parser_t *parser;
-	sdp_session_t *sdp;
+	struct sdp_parsed parsed;
 	sdp_media_t *media;
 	const char *sdp_data;
 	sdp_printer_t *printer;
 	char buf[1024];
 	const char *sdp_str;
+	const char *mode_attr;
+	size_t len;
 	char *ret;
 
 	sdp_data = other->rx_sdp;
 
-	if (!*sdp_data) {
+	if (!sdp_data) {
 		/* Legacy compat: We have not received any SDP from the other call leg. Compose some original SDP from
 		 * the RTP information we have. */
 		char *fmtp_str = NULL;
-		char *mode_attribute;
 		char ip_addr[INET6_ADDRSTRLEN];
 		char ipv;
 
@@ -269,25 +338,7 @@ char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode
 		if (strcmp(leg->wanted_codec, "AMR") == 0)
 			fmtp_str = talloc_asprintf(leg, "a=fmtp:%d octet-align=1\r\n", other->payload_type);
 
-		switch (mode) {
-		case sdp_inactive:
-			mode_attribute = "a=inactive\r\n";
-			break;
-		case sdp_sendrecv:
-			mode_attribute = "a=sendrecv\r\n";
-			break;
-		case sdp_sendonly:
-			mode_attribute = "a=sendonly\r\n";
-			break;
-		case sdp_recvonly:
-			mode_attribute = "a=recvonly\r\n";
-			break;
-		default:
-			OSMO_ASSERT(false);
-			break;
-		}
-
-		return talloc_asprintf(leg,
+		return talloc_asprintf(other,
 				       "v=0\r\n"
 				       "o=Osmocom 0 0 IN IP%c %s\r\n"
 				       "s=GSM Call\r\n"
@@ -296,45 +347,49 @@ char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode
 				       "m=audio %d RTP/AVP %d\r\n"
 				       "%s"
 				       "a=rtpmap:%d %s/8000\r\n"
-				       "%s",
+				       "a=%s\r\n",
 				       ipv, ip_addr, ipv, ip_addr,
 				       osmo_sockaddr_port((const struct sockaddr *)&other->addr),
 				       other->payload_type,
 				       fmtp_str ? fmtp_str : "",
 				       other->payload_type,
 				       leg->wanted_codec,
-				       mode_attribute);
+				       sdp_mode_name(mode));
 	}
 
-	/* We have received SDP from the other call leg. Forward this as-is, only apply the mode the caller requests:
-	 * parse SDP, set media mode, recompose. */
-	/* TODO: currently, we often detect the media mode from parsing SDP, and then forward the same SDP, applying the
-	 * same mode to it below. It may make sense to completely skip parsing and composition: the mode is usually
-	 * already in the received SDP.
-	 * However, there are some invocations of this function (sdp_create_file()) with hardcoded modes. Take a look if
-	 * that is really necessary, and if not, just drop below parsing + recomposition and use the sdp_data as is.
-	 */
-	parser = sdp_parse(NULL, sdp_data, strlen(sdp_data), 0);
-	if (!parser) {
-		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed to parse SDP\n", other);
-		return talloc_strdup(leg, sdp_data);
+	/* We have received SDP from the other call leg. Forward this as-is, only apply the mode the caller requests.
+	 * In the common case of a single audio stream the mode is usually already in the received SDP: forward it
+	 * unchanged, patch the direction attribute in place or append one, without a parse/print cycle. */
+	len = other->rx_sdp_len;
+	if (sdp_scan_mode(sdp_data, &mode_attr)) {
+		if (mode_attr) {
+			/* Already in the wanted mode: share the received SDP instead of copying it */
+			if (!memcmp(mode_attr, sdp_mode_name(mode), SDP_MODE_NAME_LEN))
+				return talloc_reference(other, other->rx_sdp);
+			ret = talloc_strndup(other, sdp_data, len);
+			if (ret)
+				memcpy(ret + (mode_attr - sdp_data), sdp_mode_name(mode), SDP_MODE_NAME_LEN);
+			return ret;
+		}
+		if (len >= 2 && strcmp(sdp_data + len - 2, "\r\n") == 0)
+			return talloc_asprintf(other, "%sa=%s\r\n", sdp_data, sdp_mode_name(mode));
 	}
 
-	sdp = sdp_session(parser);
-	if (!sdp) {
+	/* Multiple media descriptions or unusual formatting: parse SDP, set media mode, recompose. */
+	if (!sdp_parse_data(&parsed, sdp_data, len, 0)) {
 		LOGP(DSIP, LOGL_INFO, "leg(%p) no SDP session in %s, returning SDP unchanged\n", other, osmo_quote_str(sdp_data, -1));
-		sdp_parser_free(parser);
-		return talloc_strdup(leg, sdp_data);
+		sdp_parsed_free(&parsed);
+		return talloc_strdup(other, sdp_data);
 	}
 
-	for (media = sdp->sdp_media; media; media = media->m_next)
+	for (media = parsed.session->sdp_media; media; media = media->m_next)
 		media->m_mode = mode;
 
-	printer = sdp_print(NULL, sdp, buf, sizeof(buf), sdp_f_mode_always);
+	printer = sdp_print(NULL, parsed.session, buf, sizeof(buf), sdp_f_mode_always);
 	if (!printer) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) failed to print SDP\n", other);
-		sdp_parser_free(parser);
-		return talloc_strdup(leg, sdp_data);
+		sdp_parsed_free(&parsed);
+		return talloc_strdup(other, sdp_data);
 	}
 
 	sdp_str = sdp_message(printer);
@@ -343,9 +398,29 @@ char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode
 		sdp_str = sdp_data;
 	}
 
-	ret = talloc_strdup(leg, sdp_str);
+	ret = talloc_strdup(other, sdp_str);
 
-	sdp_parser_free(parser);
+	sdp_parsed_free(&parsed);
 	sdp_printer_free(printer);
 	return ret;
 }
+
+/* Like sdp_render(), but cache the result in the source leg: repeated offers and answers within one call reuse the
+ * SDP rendered earlier until the source leg receives new SDP.
+ * \return  SDP string owned by 'other', valid until its SDP changes. Do not free.
+ */
+const char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode_t mode)
+{
+	char **cached;
+
+	OSMO_ASSERT(mode < ARRAY_SIZE(other->sdp_cache));
+	cached = &other->sdp_cache[mode];
+
+	/* Without received SDP the result depends on the RTP information, which may change at any time. */
+	if (*cached && other->rx_sdp)
+		return *cached;
+
+	talloc_unlink(other, *cached);
+	*cached = sdp_render(leg, other, mode);
+	return *cached;
+}
@@ -8,7 +8,18 @@
 struct sip_call_leg;
 struct call_leg;
 
-bool sdp_get_sdp_mode(const sip_t *sip, sdp_mode_t *mode);
-bool sdp_screen_sdp(const sip_t *sip);
-bool sdp_extract_sdp(struct sip_call_leg *leg, const sip_t *sip, bool any_codec);
-char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode_t mode);
+/* SDP body of one message, parsed once by sdp_parse_sip() */
+struct sdp_parsed {
+	const char *data;
+	size_t len;
+	sdp_parser_t *parser;
+	sdp_session_t *session;
+};
+
+bool sdp_parse_sip(struct sdp_parsed *sdp, const sip_t *sip);
+void sdp_parsed_free(struct sdp_parsed *sdp);
+
+bool sdp_get_sdp_mode(const struct sdp_parsed *sdp, sdp_mode_t *mode);
+bool sdp_screen_sdp(const struct sdp_parsed *sdp);
+bool sdp_extract_sdp(struct sip_call_leg *leg, const struct sdp_parsed *sdp, bool any_codec);
+const char *sdp_create_file(struct sip_call_leg *leg, struct call_leg *other, sdp_mode_t mode);
@@ -23,9 +23,11 @@
 #include "call.h"
 #include "logging.h"
 #include "sdp.h"
+#include "latency.h"
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/socket.h>
+#include <osmocom/core/timer.h>
 #include <osmocom/gsm/tlv.h>
 
 #include <sofia-sip/sip_status.h>
@@ -45,6 +47,7 @@ static void sip_connect_call(struct call_leg *_leg);
 static void sip_dtmf_call(struct call_leg *_leg, int keypad);
 static void sip_hold_call(struct call_leg *_leg);
 static void sip_retrieve_call(struct call_leg *_leg);
+static void options_result(struct sip_trunk *trunk, nua_handle_t *nh, int status);
 
 static const char *sip_get_sdp(const sip_t *sip)
 {
@@ -56,40 +59,27 @@ static const char *sip_get_sdp(const sip_t *sip)
 /* Find a SIP Call leg by given nua_handle */
 static struct sip_call_leg *sip_find_leg(nua_handle_t *nh)
 {
-	struct call *call;
-
-	llist_for_each_entry(call, &g_call_list, entry) {
-		if (call->initial && call->initial->type == CALL_TYPE_SIP) {
-			struct sip_call_leg *leg = (struct sip_call_leg *) call->initial;
-			if (leg->nua_handle == nh)
-				return leg;
-		}
-		if (call->remote && call->remote->type == CALL_TYPE_SIP) {
-			struct sip_call_leg *leg = (struct sip_call_leg *) call->remote;
-			if (leg->nua_handle == nh)
-				return leg;
-		}
-	}
-
-	return NULL;
+	return call_sip_leg_find(nh);
 }
 
-static void call_progress(struct sip_call_leg *leg, const sip_t *sip, int status)
+static void call_progress(struct sip_call_leg *leg, const struct sdp_parsed *sdp, int status)
 {
 	struct call_leg *other = call_leg_other(&leg->base);
 
 	if (!other)
 		return;
 
+	call_stamp(leg->base.call, CALL_TS_RINGING);
+
 	/* Extract SDP for session in progress with matching codec */
-	if ((status == 180 || status == 183) && sip->sip_payload && sip->sip_payload->pl_data)
-		sdp_extract_sdp(leg, sip, false);
+	if ((status == 180 || status == 183) && sdp->session)
+		sdp_extract_sdp(leg, sdp, false);
 
 	LOGP(DSIP, LOGL_INFO, "leg(%p) is now progressing.\n", leg);
 	other->ring_call(other);
 }
 
-static void call_connect(struct sip_call_leg *leg, const sip_t *sip)
+static void call_connect(struct sip_call_leg *leg, const sip_t *sip, const struct sdp_parsed *sdp)
 {
 	/* extract SDP file and if compatible continue */
 	struct call_leg *other = call_leg_other(&leg->base);
@@ -100,7 +90,7 @@ static void call_connect(struct sip_call_leg *leg, const sip_t *sip)
 		return;
 	}
 
-	if (!sdp_extract_sdp(leg, sip, false)) {
+	if (!sdp_extract_sdp(leg, sdp, false)) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) incompatible audio, releasing\n", leg);
 		nua_cancel(leg->nua_handle, TAG_END());
 		other->release_call(other);
@@ -108,13 +98,14 @@ static void call_connect(struct sip_call_leg *leg, const sip_t *sip)
 	}
 
 	LOGP(DSIP, LOGL_INFO, "leg(%p) is now connected(%s).\n", leg, sip->sip_call_id->i_id);
+	call_stamp(leg->base.call, CALL_TS_ANSWER);
 	leg->state = SIP_CC_CONNECTED;
 	other->connect_call(other);
 	nua_ack(leg->nua_handle, TAG_END());
 }
 
 static void new_call(struct sip_agent *agent, nua_handle_t *nh,
-			const sip_t *sip)
+			const sip_t *sip, const struct sdp_parsed *sdp)
 {
 	struct call *call;
 	struct sip_call_leg *leg;
@@ -122,8 +113,22 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 	char ip_addr[INET6_ADDRSTRLEN];
 	bool xgcr_hdr_present = false;
 	uint8_t xgcr_hdr[28] = { 0 };
+	struct osmo_gcr_parsed gcr;
+	char retry_after[16];
 
 	LOGP(DSIP, LOGL_INFO, "Incoming call(%s) handle(%p)\n", sip->sip_call_id->i_id, nh);
+	call_ctr_inc(CALL_CTR_MT_ATTEMPT);
+
+	/* shed load before anything is allocated for the call */
+	if (admission_check() != ADMISSION_OK) {
+		snprintf(retry_after, sizeof(retry_after), "%u", g_app.admission.retry_after);
+		nua_respond(nh, SIP_503_SERVICE_UNAVAILABLE,
+			    TAG_IF(g_app.admission.retry_after, SIPTAG_RETRY_AFTER_STR(retry_after)),
+			    TAG_END());
+		nua_handle_destroy(nh);
+		call_ctr_rejected(GSM48_CC_CAUSE_SWITCH_CONG);
+		return;
+	}
 
 	sip_unknown_t *unknown_header = sip->sip_unknown;
 	while (unknown_header != NULL) {
@@ -135,25 +140,21 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 		unknown_header = unknown_header->un_next;
 	}
 
-	if (!sdp_screen_sdp(sip)) {
+	if (!sdp_screen_sdp(sdp)) {
 		LOGP(DSIP, LOGL_ERROR, "No supported codec.\n");
 		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
 		nua_handle_destroy(nh);
+		call_ctr_rejected(GSM48_CC_CAUSE_CHAN_UNACCEPT);
 		return;
 	}
 
-	call = call_sip_create();
-	OSMO_ASSERT(call);
-
 	/* Decode Decode the Global Call Reference (if present) */
-	if (xgcr_hdr_present) {
-		if (osmo_dec_gcr(&call->gcr, xgcr_hdr, sizeof(xgcr_hdr)) < 0) {
-			LOGP(DSIP, LOGL_ERROR, "Failed to parse X-Global-Call-Ref.\n");
-			nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
-			nua_handle_destroy(nh);
-			return;
-		}
-		call->gcr_present = true;
+	if (xgcr_hdr_present && osmo_dec_gcr(&gcr, xgcr_hdr, sizeof(xgcr_hdr)) < 0) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to parse X-Global-Call-Ref.\n");
+		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
+		nua_handle_destroy(nh);
+		call_ctr_rejected(GSM48_CC_CAUSE_CHAN_UNACCEPT);
+		return;
 	}
 
 	if (sip->sip_to)
@@ -165,9 +166,18 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 		LOGP(DSIP, LOGL_ERROR, "Unknown from/to for invite.\n");
 		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
 		nua_handle_destroy(nh);
+		call_ctr_rejected(GSM48_CC_CAUSE_CHAN_UNACCEPT);
 		return;
 	}
 
+	call = call_sip_create();
+	OSMO_ASSERT(call);
+
+	if (xgcr_hdr_present) {
+		call->gcr = gcr;
+		call->gcr_present = true;
+	}
+
 	leg = (struct sip_call_leg *) call->initial;
 	leg->state = SIP_CC_DLG_CNFD;
 	leg->dir = SIP_DIR_MO;
@@ -179,10 +189,11 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 	 * are GSM related... and do not belong here. Just pick the first codec
 	 * so the IP address, port and payload type is set.
 	 */
-	if (!sdp_extract_sdp(leg, sip, true)) {
+	if (!sdp_extract_sdp(leg, sdp, true)) {
 		LOGP(DSIP, LOGL_ERROR, "leg(%p) no audio, releasing\n", leg);
 		nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
 		nua_handle_destroy(nh);
+		leg->base.cause = GSM48_CC_CAUSE_CHAN_UNACCEPT;
 		call_leg_release(&leg->base);
 		return;
 	}
@@ -200,7 +211,7 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 	leg->agent = agent;
 	leg->nua_handle = nh;
 	nua_handle_bind(nh, leg);
-	leg->sdp_payload = talloc_strdup(leg, sip->sip_payload->pl_data);
+	call_sip_leg_add(leg);
 
 	call_leg_rx_sdp(&leg->base, sip_get_sdp(sip));
 
@@ -209,9 +220,10 @@ static void new_call(struct sip_agent *agent, nua_handle_t *nh,
 			talloc_strdup(leg, to));
 }
 
-static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, const sip_t *sip) {
+static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, const sip_t *sip,
+				const struct sdp_parsed *parsed) {
 
-	char *sdp;
+	const char *sdp;
 	sdp_mode_t mode = sdp_sendrecv;
 	char ip_addr[INET6_ADDRSTRLEN];
 	struct sockaddr_storage prev_addr = leg->base.addr;
@@ -226,7 +238,7 @@ static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, cons
 		return;
 	}
 
-	if (!sdp_get_sdp_mode(sip, &mode)) {
+	if (!sdp_get_sdp_mode(parsed, &mode)) {
 		/* re-INVITE with no SDP.
 		 * We should respond with SDP reflecting current session
 		 */
@@ -236,7 +248,6 @@ static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, cons
 			    SIPTAG_CONTENT_TYPE_STR("application/sdp"),
 			    SIPTAG_PAYLOAD_STR(sdp),
 			    TAG_END());
-		talloc_free(sdp);
 		return;
 	}
 
@@ -252,7 +263,7 @@ static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, cons
 		/* TODO: Tell core network to stop sending RTP ? */
 	} else {
 		/* SIP re-INVITE may want to change media, IP, port */
-		if (!sdp_extract_sdp(leg, sip, true)) {
+		if (!sdp_extract_sdp(leg, parsed, true)) {
 			LOGP(DSIP, LOGL_ERROR, "leg(%p) no audio, releasing\n", leg);
 			nua_respond(nh, SIP_406_NOT_ACCEPTABLE, TAG_END());
 			nua_handle_destroy(nh);
@@ -283,7 +294,6 @@ static void sip_handle_reinvite(struct sip_call_leg *leg, nua_handle_t *nh, cons
 		    SIPTAG_CONTENT_TYPE_STR("application/sdp"),
 		    SIPTAG_PAYLOAD_STR(sdp),
 		    TAG_END());
-	talloc_free(sdp);
 	return;
 }
 
@@ -356,16 +366,29 @@ static int status2cause(int status)
 	return GSM48_CC_CAUSE_NORMAL_UNSPEC;
 }
 
-void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
+static void nua_dispatch(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
 {
-	LOGP(DSIP, LOGL_DEBUG, "SIP event[%s] status(%d) phrase(%s) SDP(%s) %p\n",
-		nua_event_name(event), status, phrase, sip_get_sdp(sip), hmagic);
+	LOGP_HOT(DSIP, "SIP event[%s] status(%d) phrase(%s) SDP(%s) %p\n",
+		 nua_event_name(event), status, phrase, sip_get_sdp(sip), hmagic);
 
 	if (event == nua_r_invite) {
 		struct sip_call_leg *leg;
+		struct sdp_parsed sdp = { 0, };
 		leg = (struct sip_call_leg *) hmagic;
+		bool reinvite = leg->state == SIP_CC_CONNECTED || leg->state == SIP_CC_HOLD;
 
 		call_leg_rx_sdp(&leg->base, sip_get_sdp(sip));
+		/* only progress and the answer to the initial INVITE look at the SDP */
+		if (status == 180 || status == 183 || (status == 200 && !reinvite))
+			sdp_parse_sip(&sdp, sip);
+		/* re-INVITEs for hold/retrieve would inflate the counters */
+		if (!reinvite)
+			call_ctr_sip_final(status);
+
+		/* only the initial INVITE tells whether the remote takes calls */
+		if (leg->trunk && status >= 200 && !reinvite)
+			breaker_result(&leg->trunk->breaker, status,
+				       sip && sip->sip_retry_after ? sip->sip_retry_after->ra_delta : 0);
 
 		/* MT call is moving forward */
 
@@ -374,14 +397,14 @@ void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua,
 			leg->state = SIP_CC_DLG_CNFD;
 
 		if (status == 180 || status == 183)
-			call_progress(leg, sip, status);
+			call_progress(leg, &sdp, status);
 		else if (status == 200) {
 			if (leg->state == SIP_CC_CONNECTED || leg->state == SIP_CC_HOLD) {
 				/* This 200 is a response to our re-INVITE on
 				 * a connected call. We just need to ACK it. */
 				nua_ack(leg->nua_handle, TAG_END());
 			} else {
-				call_connect(leg, sip);
+				call_connect(leg, sip, &sdp);
 			}
 		}
 		else if (status >= 300) {
@@ -403,14 +426,26 @@ void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua,
 				other->release_call(other);
 			}
 		}
+		sdp_parsed_free(&sdp);
+	} else if (event == nua_r_options) {
+		options_result((struct sip_trunk *) hmagic, nh, status);
 	} else if (event == nua_i_ack) {
+		struct sip_call_leg *leg = sip_find_leg(nh);
+
+		/* The ACK to our 200 completes the setup of an MT call */
+		if (leg)
+			call_stamp(leg->base.call, CALL_TS_CONNECTED);
+
 		/* SDP comes back to us in 200 ACK after we
 		 * respond to the re-INVITE query. */
 		if (sip->sip_payload && sip->sip_payload->pl_data) {
-			struct sip_call_leg *leg = sip_find_leg(nh);
 			if (leg) {
+				struct sdp_parsed sdp;
+
 				call_leg_rx_sdp(&leg->base, sip_get_sdp(sip));
-				sip_handle_reinvite(leg, nh, sip);
+				sdp_parse_sip(&sdp, sip);
+				sip_handle_reinvite(leg, nh, sip, &sdp);
+				sdp_parsed_free(&sdp);
 			}
 		}
 	} else if (event == nua_r_bye || event == nua_r_cancel) {
@@ -437,12 +472,16 @@ void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua,
 
 		if (status == 100) {
 			struct sip_call_leg *leg = sip_find_leg(nh);
+			struct sdp_parsed sdp;
+
+			sdp_parse_sip(&sdp, sip);
 			if (leg) {
 				call_leg_rx_sdp(&leg->base, sip_get_sdp(sip));
-				sip_handle_reinvite(leg, nh, sip);
+				sip_handle_reinvite(leg, nh, sip, &sdp);
 			} else {
-				new_call((struct sip_agent *) magic, nh, sip);
+				new_call((struct sip_agent *) magic, nh, sip, &sdp);
 			}
+			sdp_parsed_free(&sdp);
 		}
 	} else if (event == nua_i_cancel) {
 		struct sip_call_leg *leg;
@@ -462,6 +501,15 @@ void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua,
 	}
 }
 
+void nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *magic, nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[])
+{
+	struct timespec start;
+
+	latency_start(&start);
+	nua_dispatch(event, status, phrase, nua, magic, nh, hmagic, sip, tags);
+	latency_record(LATENCY_SIP, event, &start);
+}
+
 static void cause2status(int cause, int *sip_status, const char **sip_phrase, const char **reason_text)
 {
 	uint8_t i;
@@ -545,7 +593,7 @@ static void sip_connect_call(struct call_leg *_leg)
 {
 	struct call_leg *other;
 	struct sip_call_leg *leg;
-	char *sdp;
+	const char *sdp;
 
 	OSMO_ASSERT(_leg->type == CALL_TYPE_SIP);
 	leg = (struct sip_call_leg *) _leg;
@@ -568,7 +616,6 @@ static void sip_connect_call(struct call_leg *_leg)
 			SIPTAG_CONTENT_TYPE_STR("application/sdp"),
 			SIPTAG_PAYLOAD_STR(sdp),
 			TAG_END());
-	talloc_free(sdp);
 }
 
 static void sip_dtmf_call(struct call_leg *_leg, int keypad)
@@ -599,13 +646,12 @@ static void sip_hold_call(struct call_leg *_leg)
 		sip_release_call(&leg->base);
 		return;
 	}
-	char *sdp = sdp_create_file(leg, other_leg, sdp_sendonly);
+	const char *sdp = sdp_create_file(leg, other_leg, sdp_sendonly);
 	nua_invite(leg->nua_handle,
 		    NUTAG_MEDIA_ENABLE(0),
 		    SIPTAG_CONTENT_TYPE_STR("application/sdp"),
 		    SIPTAG_PAYLOAD_STR(sdp),
 		    TAG_END());
-	talloc_free(sdp);
 	leg->state = SIP_CC_HOLD;
 }
 
@@ -621,16 +667,21 @@ static void sip_retrieve_call(struct call_leg *_leg)
 		sip_release_call(&leg->base);
 		return;
 	}
-	char *sdp = sdp_create_file(leg, other_leg, sdp_sendrecv);
+	const char *sdp = sdp_create_file(leg, other_leg, sdp_sendrecv);
 	nua_invite(leg->nua_handle,
 		    NUTAG_MEDIA_ENABLE(0),
 		    SIPTAG_CONTENT_TYPE_STR("application/sdp"),
 		    SIPTAG_PAYLOAD_STR(sdp),
 		    TAG_END());
-	talloc_free(sdp);
 	leg->state = SIP_CC_CONNECTED;
 }
 
+/* The port this process listens on, local_port unless it is a worker */
+static int sip_local_port(struct sip_agent *agent)
+{
+	return agent->app->sip.worker_port ? agent->app->sip.worker_port : agent->app->sip.local_port;
+}
+
 static int send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
 			const char *calling_num, const char *called_num)
 {
@@ -639,12 +690,12 @@ static int send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
 	char *from = talloc_asprintf(leg, "sip:%s@%s:%d",
 				calling_num,
 				agent->app->sip.local_addr,
-				agent->app->sip.local_port);
+				sip_local_port(agent));
 	char *to = talloc_asprintf(leg, "sip:%s@%s:%d",
 				called_num,
-				agent->app->sip.remote_addr,
-				agent->app->sip.remote_port);
-	char *sdp = sdp_create_file(leg, other, sdp_sendrecv);
+				leg->trunk->addr,
+				leg->trunk->port);
+	const char *sdp = sdp_create_file(leg, other, sdp_sendrecv);
 
 	/* Encode the Global Call Reference (if present) */
 	char *x_gcr = NULL;
@@ -671,26 +722,63 @@ static int send_invite(struct sip_agent *agent, struct sip_call_leg *leg,
 			TAG_END());
 
 	leg->base.call->remote = &leg->base;
+	call_stamp(leg->base.call, CALL_TS_INVITE);
 	talloc_free(from);
 	talloc_free(to);
-	talloc_free(sdp);
 	talloc_free(x_gcr);
 	return 0;
 }
 
+/*
+ * Pick the remote for a new call among the ones that are up and whose
+ * circuit breaker lets calls through.
+ */
+static struct sip_trunk *select_trunk(struct sip_agent *agent)
+{
+	struct sip_trunk *trunk, *best = NULL;
+	int total = 0;
+
+	llist_for_each_entry(trunk, &agent->app->sip.trunks, entry) {
+		if (trunk->down || !breaker_available(&trunk->breaker))
+			continue;
+
+		if (agent->app->sip.trunk_selection == SIP_TRUNK_ROUND_ROBIN) {
+			/* smooth weighted round-robin as in nginx, spreads a heavy remote over the cycle */
+			trunk->rr_current += trunk->weight;
+			total += trunk->weight;
+			if (!best || trunk->rr_current > best->rr_current)
+				best = trunk;
+		} else if (!best || (unsigned long long) trunk->active_calls * best->weight
+					< (unsigned long long) best->active_calls * trunk->weight) {
+			best = trunk;
+		}
+	}
+
+	if (!best)
+		return NULL;
+	best->rr_current -= total;
+	return breaker_allow(&best->breaker) ? best : NULL;
+}
+
 int sip_create_remote_leg(struct sip_agent *agent, struct call *call)
 {
 	struct sip_call_leg *leg;
+	struct sip_trunk *trunk;
 
-	leg = talloc_zero(call, struct sip_call_leg);
+	trunk = select_trunk(agent);
+	if (!trunk) {
+		LOGP(DSIP, LOGL_ERROR, "No SIP remote available for call(%u)\n",
+			call->id);
+		return -3;
+	}
+
+	leg = call_sip_leg_alloc(call);
 	if (!leg) {
 		LOGP(DSIP, LOGL_ERROR, "Failed to allocate leg for call(%u)\n",
 			call->id);
 		return -1;
 	}
 
-	leg->base.type = CALL_TYPE_SIP;
-	leg->base.call = call;
 	leg->base.release_call = sip_release_call;
 	leg->base.dtmf = sip_dtmf_call;
 	leg->base.hold_call = sip_hold_call;
@@ -701,13 +789,178 @@ int sip_create_remote_leg(struct sip_agent *agent, struct call *call)
 	if (!leg->nua_handle) {
 		LOGP(DSIP, LOGL_ERROR, "Failed to allocate nua for call(%u)\n",
 			call->id);
-		talloc_free(leg);
+		call_leg_free(&leg->base);
 		return -2;
 	}
+	call_sip_leg_add(leg);
+	leg->trunk = trunk;
+	trunk->active_calls += 1;
 
+	LOGP(DSIP, LOGL_DEBUG, "call(%u) sending to remote %s:%d\n",
+		call->id, trunk->addr, trunk->port);
 	return send_invite(agent, leg, call->source, call->dest);
 }
 
+/*
+ * Whether a new call may be sent to one of the remotes. Returns 0 if so,
+ * else the GSM 04.08 cause to reject the call with, mapped from the SIP
+ * status that opened a circuit breaker.
+ */
+int sip_agent_reject_cause(struct sip_agent *agent)
+{
+	struct sip_trunk *trunk;
+	int cause = GSM48_CC_CAUSE_NETWORK_OOO;
+
+	if (llist_empty(&agent->app->sip.trunks))
+		return 0;
+
+	llist_for_each_entry(trunk, &agent->app->sip.trunks, entry) {
+		if (trunk->down)
+			continue;
+		if (breaker_available(&trunk->breaker))
+			return 0;
+		cause = status2cause(trunk->breaker.open_status);
+	}
+	return cause;
+}
+
+const struct value_string sip_trunk_selection_names[] = {
+	{ SIP_TRUNK_ROUND_ROBIN,	"round-robin" },
+	{ SIP_TRUNK_LEAST_CALLS,	"least-calls" },
+	{ 0, NULL },
+};
+
+/* a remote is taken out after this many OPTIONS in a row failed */
+#define TRUNK_DOWN_AFTER	2
+
+static struct osmo_timer_list options_timer;
+
+void sip_trunk_init(struct sip_trunk *trunk, struct sip_agent *agent)
+{
+	trunk->agent = agent;
+	trunk->weight = 1;
+	breaker_init(&trunk->breaker, &agent->app->sip.breaker);
+}
+
+/* Unlink and free the remote, calls on it stay up */
+void sip_trunk_free(struct sip_trunk *trunk)
+{
+	struct call *call;
+
+	llist_for_each_entry(call, &g_call_list, entry) {
+		struct call_leg *leg = call->remote;
+
+		if (leg && leg->type == CALL_TYPE_SIP && ((struct sip_call_leg *) leg)->trunk == trunk)
+			((struct sip_call_leg *) leg)->trunk = NULL;
+	}
+
+	if (trunk->options_nh)
+		nua_handle_destroy(trunk->options_nh);
+	llist_del(&trunk->entry);
+	talloc_free(trunk);
+}
+
+static void options_result(struct sip_trunk *trunk, nua_handle_t *nh, int status)
+{
+	struct timespec now;
+	unsigned int rtt;
+
+	/* a provisional response to OPTIONS, keep waiting */
+	if (status < 200)
+		return;
+
+	nua_handle_destroy(nh);
+	trunk->options_nh = NULL;
+
+	/* no answer (sofia-sip reports 408) or the remote is overloaded */
+	if (status == 408 || status >= 500) {
+		trunk->probe_failures += 1;
+		if (!trunk->down && trunk->probe_failures >= TRUNK_DOWN_AFTER) {
+			LOGP(DSIP, LOGL_NOTICE, "remote %s:%d is down, OPTIONS got status(%d)\n",
+				trunk->addr, trunk->port, status);
+			trunk->down = true;
+		}
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rtt = (now.tv_sec - trunk->options_sent.tv_sec) * 1000
+		+ (now.tv_nsec - trunk->options_sent.tv_nsec) / 1000000;
+	trunk->rtt_last = rtt;
+	trunk->rtt_avg = trunk->rtt_avg ? (trunk->rtt_avg * 7 + rtt) / 8 : rtt;
+
+	trunk->probe_failures = 0;
+	if (trunk->down) {
+		LOGP(DSIP, LOGL_NOTICE, "remote %s:%d is up again, rtt(%ums)\n",
+			trunk->addr, trunk->port, rtt);
+		trunk->down = false;
+	}
+}
+
+static void options_send(struct sip_trunk *trunk)
+{
+	struct sip_agent *agent = trunk->agent;
+	char *to;
+
+	/* the previous OPTIONS went unanswered for a whole interval */
+	if (trunk->options_nh) {
+		nua_handle_destroy(trunk->options_nh);
+		trunk->options_nh = NULL;
+		trunk->probe_failures += 1;
+		if (!trunk->down && trunk->probe_failures >= TRUNK_DOWN_AFTER) {
+			LOGP(DSIP, LOGL_NOTICE, "remote %s:%d is down, OPTIONS not answered\n",
+				trunk->addr, trunk->port);
+			trunk->down = true;
+		}
+	}
+
+	to = talloc_asprintf(trunk, "sip:%s:%d", trunk->addr, trunk->port);
+	trunk->options_nh = nua_handle(agent->nua, trunk, SIPTAG_TO_STR(to), TAG_END());
+	talloc_free(to);
+	if (!trunk->options_nh) {
+		LOGP(DSIP, LOGL_ERROR, "Failed to allocate nua for OPTIONS to %s:%d\n",
+			trunk->addr, trunk->port);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &trunk->options_sent);
+	nua_options(trunk->options_nh, TAG_END());
+}
+
+static void options_tick(void *data)
+{
+	struct sip_agent *agent = data;
+	struct sip_trunk *trunk;
+
+	llist_for_each_entry(trunk, &agent->app->sip.trunks, entry)
+		options_send(trunk);
+
+	osmo_timer_schedule(&options_timer, agent->app->sip.options_interval, 0);
+}
+
+/* (Re)start the OPTIONS health checks after the interval was changed */
+void sip_agent_options_start(struct sip_agent *agent)
+{
+	struct sip_trunk *trunk;
+
+	osmo_timer_del(&options_timer);
+	if (agent->app->sip.options_interval) {
+		osmo_timer_setup(&options_timer, options_tick, agent);
+		options_tick(agent);
+		return;
+	}
+
+	/* without health checks every remote counts as up */
+	llist_for_each_entry(trunk, &agent->app->sip.trunks, entry) {
+		if (trunk->options_nh) {
+			nua_handle_destroy(trunk->options_nh);
+			trunk->options_nh = NULL;
+		}
+		trunk->probe_failures = 0;
+		trunk->down = false;
+	}
+}
+
 char *make_sip_uri(struct sip_agent *agent)
 {
 	const char *hostname = agent->app->sip.local_addr;
@@ -718,7 +971,7 @@ char *make_sip_uri(struct sip_agent *agent)
 
 	return talloc_asprintf(tall_mncc_ctx, "sip:%s:%d",
 				agent->app->sip.local_addr,
-				agent->app->sip.local_port);
+				sip_local_port(agent));
 }
 
 /* http://sofia-sip.sourceforge.net/refdocs/debug_logs.html */
@@ -752,7 +1005,17 @@ void sip_agent_init(struct sip_agent *agent, struct app_config *app)
 	su_log_redirect(su_log_default, &sip_logger, NULL);
 	su_log_redirect(su_log_global, &sip_logger, NULL);
 	agent->root = su_glib_root_create(NULL);
-	su_root_threading(agent->root, 0);
+
+	/*
+	 * With threading the nua stack (parsing, transactions and
+	 * retransmissions) runs in a thread of its own and hands its events
+	 * to nua_callback() on our glib main loop, so the call handling
+	 * stays single threaded. Only the sofia-sip log handler is called
+	 * from the stack thread.
+	 */
+	if (app->sip.stack_thread)
+		log_enable_multithread();
+	su_root_threading(agent->root, app->sip.stack_thread);
 }
 
 int sip_agent_start(struct sip_agent *agent)
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "breaker.h"
+
+#include <osmocom/core/linuxlist.h>
+
 #include <sofia-sip/su_wait.h>
 #include <sofia-sip/url.h>
 #include <sofia-sip/sip.h>
@@ -18,7 +22,45 @@ struct sip_agent {
 	nua_t			*nua;
 };
 
+enum sip_trunk_selection {
+	SIP_TRUNK_ROUND_ROBIN,
+	SIP_TRUNK_LEAST_CALLS,
+};
+
+/* A SIP remote the calls from the MSC are sent to */
+struct sip_trunk {
+	struct llist_head	entry;
+	struct sip_agent	*agent;
+	const char		*addr;
+	int			port;
+	unsigned int		weight;
+
+	/* smooth weighted round-robin, see select_trunk() */
+	int			rr_current;
+	/* calls sent to this remote that are not released yet */
+	unsigned int		active_calls;
+
+	/* guards the remote against calls while it fails */
+	struct circuit_breaker	breaker;
+
+	/* OPTIONS health check, the remote is left out while down */
+	bool			down;
+	unsigned int		probe_failures;
+	nua_handle_t		*options_nh;
+	struct timespec		options_sent;
+	/* round trip time of the OPTIONS in ms, last and smoothed */
+	unsigned int		rtt_last;
+	unsigned int		rtt_avg;
+};
+
 void sip_agent_init(struct sip_agent *agent, struct app_config *app);
 int sip_agent_start(struct sip_agent *agent);
 
 int sip_create_remote_leg(struct sip_agent *agent, struct call *call);
+int sip_agent_reject_cause(struct sip_agent *agent);
+void sip_agent_options_start(struct sip_agent *agent);
+
+void sip_trunk_init(struct sip_trunk *trunk, struct sip_agent *agent);
+void sip_trunk_free(struct sip_trunk *trunk);
+
+extern const struct value_string sip_trunk_selection_names[];
@@ -0,0 +1,193 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "supervisor.h"
+#include "app.h"
+#include "call.h"
+#include "logging.h"
+#include "mncc_mux.h"
+
+#include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/vty/telnet_interface.h>
+#include <osmocom/vty/vty.h>
+
+#include <talloc.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *tall_mncc_ctx;
+
+int g_worker = -1;
+unsigned int g_num_workers;
+struct worker_stats *g_worker_stats;
+
+static struct osmo_timer_list reap_timer;
+static struct osmo_timer_list stats_timer;
+static bool telnet_started;
+
+/* Collect the workers that died, they are started again by supervisor_run() */
+static void reap_workers(void *data)
+{
+	unsigned int i;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < g_num_workers; ++i) {
+			if (g_worker_stats[i].pid != pid)
+				continue;
+			LOGP(DAPP, LOGL_ERROR, "worker(%u) pid(%d) exited with status(%d), restarting\n",
+				i, pid, status);
+			g_worker_stats[i].pid = 0;
+			g_worker_stats[i].restarts += 1;
+		}
+	}
+
+	osmo_timer_schedule(&reap_timer, 1, 0);
+}
+
+/* Apply what is different in worker number i */
+static int worker_setup(struct app_config *cfg, unsigned int i)
+{
+	struct mncc_connection *conn;
+
+	g_worker = i;
+	g_worker_stats[i].pid = getpid();
+
+	/* the SIP side is not shared, each worker has a port of its own. The
+	 * configured port stays, it is what the VTY shows and saves. */
+	cfg->sip.worker_port = g_worker_stats[i].sip_port;
+
+	/* the configured path stays, it is what the VTY shows and saves */
+	llist_for_each_entry(conn, &cfg->mncc.conns, entry)
+		conn->mux_path = mncc_mux_path(conn, conn->path);
+
+	calls_set_id_space(i, g_num_workers, g_worker_stats[i].restarts);
+	return i;
+}
+
+/* Fork worker i. Returns 0 in the worker, like fork(). */
+static pid_t spawn_worker(unsigned int i)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		LOGP(DAPP, LOGL_ERROR, "worker(%u) failed to fork: %s\n", i, strerror(errno));
+		return pid;
+	}
+
+	if (pid > 0) {
+		LOGP(DAPP, LOGL_NOTICE, "worker(%u) started with pid(%d)\n", i, pid);
+		g_worker_stats[i].pid = pid;
+		return pid;
+	}
+
+	/* don't outlive the supervisor, and drop what belongs to it */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	mncc_mux_stop_all();
+	osmo_timer_del(&reap_timer);
+	if (telnet_started)
+		telnet_exit();
+	return 0;
+}
+
+/*
+ * Run as supervisor of num_workers workers. Only returns in a worker, with
+ * its number; the configuration has then been adapted for the worker.
+ */
+int supervisor_run(struct app_config *cfg, unsigned int num_workers, int base_vty_port)
+{
+	struct mncc_connection *conn;
+	unsigned int i;
+	int rc;
+
+	g_num_workers = num_workers;
+	g_worker_stats = mmap(NULL, num_workers * sizeof(*g_worker_stats), PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (g_worker_stats == MAP_FAILED) {
+		LOGP(DAPP, LOGL_ERROR, "Failed to map the worker statistics: %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(g_worker_stats, 0, num_workers * sizeof(*g_worker_stats));
+
+	/* the default MSC as in app_setup(), but all MSCs are reached through the mux */
+	if (llist_empty(&cfg->mncc.conns))
+		app_mncc_add(cfg, "/tmp/msc_mncc");
+	llist_for_each_entry(conn, &cfg->mncc.conns, entry) {
+		if (!mncc_mux_start(tall_mncc_ctx, conn->path))
+			exit(1);
+	}
+
+	for (i = 0; i < num_workers; ++i) {
+		g_worker_stats[i].sip_port = cfg->sip.local_port + i;
+		g_worker_stats[i].vty_port = vty_get_bind_port(base_vty_port) + 1 + i;
+		if (spawn_worker(i) == 0)
+			return worker_setup(cfg, i);
+	}
+
+	rc = telnet_init_default(tall_mncc_ctx, NULL, base_vty_port);
+	if (rc < 0)
+		exit(1);
+	telnet_started = true;
+
+	osmo_timer_setup(&reap_timer, reap_workers, NULL);
+	osmo_timer_schedule(&reap_timer, 1, 0);
+
+	while (1) {
+		osmo_select_main(0);
+
+		for (i = 0; i < num_workers; ++i) {
+			if (g_worker_stats[i].pid == 0 && spawn_worker(i) == 0)
+				return worker_setup(cfg, i);
+		}
+	}
+}
+
+static void stats_update(void *data)
+{
+	struct worker_stats *stats = &g_worker_stats[g_worker];
+
+	stats->calls = g_call_pools[CALL_POOL_CALL].in_use;
+	stats->setups = g_calls_in_setup;
+	stats->mo_attempts = rate_ctr_group_get_ctr(g_call_ctrs, CALL_CTR_MO_ATTEMPT)->current;
+	stats->mo_connects = rate_ctr_group_get_ctr(g_call_ctrs, CALL_CTR_MO_CONNECT)->current;
+	stats->mt_attempts = rate_ctr_group_get_ctr(g_call_ctrs, CALL_CTR_MT_ATTEMPT)->current;
+	stats->mt_connects = rate_ctr_group_get_ctr(g_call_ctrs, CALL_CTR_MT_CONNECT)->current;
+	stats->rejected = rate_ctr_group_get_ctr(g_call_ctrs, CALL_CTR_REJECTED)->current;
+
+	osmo_timer_schedule(&stats_timer, 1, 0);
+}
+
+/* Start publishing the statistics of this worker, once the calls are set up */
+void supervisor_worker_start(void)
+{
+	if (g_worker < 0)
+		return;
+
+	osmo_timer_setup(&stats_timer, stats_update, NULL);
+	stats_update(NULL);
+}
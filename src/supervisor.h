@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct app_config;
+
+/*
+ * Supervisor mode: the process forks a number of workers that each run the
+ * whole connector on their own SIP port, restarts them when they die and
+ * shares the MNCC connections to the MSCs between them, see mncc_mux.h.
+ * Every worker publishes a few numbers in a shared page so the supervisor
+ * can show the totals.
+ */
+struct worker_stats {
+	pid_t pid;
+	unsigned int restarts;
+	int sip_port;
+	int vty_port;
+
+	/* updated by the worker every second */
+	unsigned int calls;
+	unsigned int setups;
+	uint64_t mo_attempts;
+	uint64_t mo_connects;
+	uint64_t mt_attempts;
+	uint64_t mt_connects;
+	uint64_t rejected;
+};
+
+/* upper bound for -w, every worker needs a SIP and a VTY port of its own */
+#define SUPERVISOR_MAX_WORKERS	64
+
+/* negative outside of supervisor mode */
+extern int g_worker;
+extern unsigned int g_num_workers;
+extern struct worker_stats *g_worker_stats;
+
+/* The supervisor process itself, it has no SIP agent and no MNCC connections */
+static inline bool supervisor_is_running(void)
+{
+	return g_num_workers > 0 && g_worker < 0;
+}
+
+int supervisor_run(struct app_config *cfg, unsigned int num_workers, int base_vty_port);
+void supervisor_worker_start(void);
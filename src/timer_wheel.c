@@ -0,0 +1,99 @@
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "timer_wheel.h"
+
+#include <osmocom/core/utils.h>
+
+#include <time.h>
+
+static uint64_t timer_wheel_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * (1000 / TIMER_WHEEL_TICK_MS)
+		+ now.tv_nsec / (TIMER_WHEEL_TICK_MS * 1000000);
+}
+
+static struct timer_wheel_entry *timer_wheel_expired(struct hlist_head *slot, uint64_t tick)
+{
+	struct timer_wheel_entry *entry;
+
+	/* entries of later rounds share the slot */
+	hlist_for_each_entry(entry, slot, node) {
+		if (entry->expires <= tick)
+			return entry;
+	}
+	return NULL;
+}
+
+static void timer_wheel_tick(void *data)
+{
+	struct timer_wheel *wheel = data;
+	struct timer_wheel_entry *entry;
+	uint64_t now = timer_wheel_now();
+
+	/* After a long stall each slot needs to be visited only once */
+	if (now - wheel->tick > TIMER_WHEEL_SLOTS)
+		wheel->tick = now - TIMER_WHEEL_SLOTS;
+
+	/* The osmo_timer may fire late, catch up on all ticks that passed. A
+	 * call-back may remove other entries, so look up one at a time. */
+	while (wheel->tick < now && wheel->pending) {
+		struct hlist_head *slot;
+
+		wheel->tick += 1;
+		slot = &wheel->slots[wheel->tick % TIMER_WHEEL_SLOTS];
+		while ((entry = timer_wheel_expired(slot, wheel->tick))) {
+			timer_wheel_del(wheel, entry);
+			entry->cb(entry->data);
+		}
+	}
+
+	if (wheel->pending)
+		osmo_timer_schedule(&wheel->timer, 0, TIMER_WHEEL_TICK_MS * 1000);
+}
+
+/* (Re-)arm an entry. Set its cb and data before. */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, unsigned int timeout_ms)
+{
+	uint64_t ticks = OSMO_MAX((timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS, 1);
+	uint64_t now = timer_wheel_now();
+
+	timer_wheel_del(wheel, entry);
+	if (!wheel->pending)
+		wheel->tick = now;
+
+	entry->expires = OSMO_MAX(now, wheel->tick) + ticks;
+	hlist_add_head(&entry->node, &wheel->slots[entry->expires % TIMER_WHEEL_SLOTS]);
+	wheel->pending += 1;
+
+	if (!osmo_timer_pending(&wheel->timer)) {
+		osmo_timer_setup(&wheel->timer, timer_wheel_tick, wheel);
+		osmo_timer_schedule(&wheel->timer, 0, TIMER_WHEEL_TICK_MS * 1000);
+	}
+}
+
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_wheel_entry *entry)
+{
+	if (!timer_wheel_pending(entry))
+		return;
+	hlist_del_init(&entry->node);
+	wheel->pending -= 1;
+}
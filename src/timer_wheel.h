@@ -0,0 +1,40 @@
+#pragma once
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Coarse timers for guard timeouts that are armed and disarmed on most
+ * messages but hardly ever expire. Adding and removing an entry is O(1), and
+ * a single osmo_timer ticks the wheel while entries are pending. Expiry is
+ * rounded up to the next tick. Zero-initialized wheels and entries are ready
+ * to use.
+ */
+#define TIMER_WHEEL_TICK_MS	100
+#define TIMER_WHEEL_SLOTS	256
+
+struct timer_wheel_entry {
+	struct hlist_node node;
+	uint64_t expires;
+	void (*cb)(void *data);
+	void *data;
+};
+
+struct timer_wheel {
+	struct hlist_head slots[TIMER_WHEEL_SLOTS];
+	/* last tick that was processed */
+	uint64_t tick;
+	unsigned int pending;
+	struct osmo_timer_list timer;
+};
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, unsigned int timeout_ms);
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_wheel_entry *entry);
+
+static inline bool timer_wheel_pending(const struct timer_wheel_entry *entry)
+{
+	return !hlist_unhashed(&entry->node);
+}
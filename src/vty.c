@@ -23,6 +23,9 @@
 #include "app.h"
 #include "call.h"
 #include "mncc.h"
+#include "latency.h"
+#include "supervisor.h"
+#include "mncc_mux.h"
 
 #include <talloc.h>
 
@@ -81,17 +84,54 @@ static int mncc_vty_go_parent(struct vty *vty)
 
 static int config_write_sip(struct vty *vty)
 {
+	struct sip_trunk *trunk;
+
 	vty_out(vty, "sip%s", VTY_NEWLINE);
 	vty_out(vty, " local %s %d%s", g_app.sip.local_addr, g_app.sip.local_port, VTY_NEWLINE);
-	vty_out(vty, " remote %s %d%s", g_app.sip.remote_addr, g_app.sip.remote_port, VTY_NEWLINE);
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		if (trunk->weight == 1)
+			vty_out(vty, " remote %s %d%s", trunk->addr, trunk->port, VTY_NEWLINE);
+		else
+			vty_out(vty, " remote %s %d weight %u%s", trunk->addr, trunk->port,
+				trunk->weight, VTY_NEWLINE);
+	}
+	if (g_app.sip.trunk_selection != SIP_TRUNK_ROUND_ROBIN)
+		vty_out(vty, " trunk-selection %s%s",
+			get_value_string(sip_trunk_selection_names, g_app.sip.trunk_selection), VTY_NEWLINE);
+	if (g_app.sip.options_interval)
+		vty_out(vty, " options-interval %u%s", g_app.sip.options_interval, VTY_NEWLINE);
 	vty_out(vty, " sofia-sip log-level %d%s", g_app.sip.sofia_log_level, VTY_NEWLINE);
+	if (g_app.sip.stack_thread)
+		vty_out(vty, " sofia-sip stack-thread%s", VTY_NEWLINE);
+	if (g_app.sip.breaker.failure_percent)
+		vty_out(vty, " circuit-breaker failure-percent %u%s",
+			g_app.sip.breaker.failure_percent, VTY_NEWLINE);
+	if (g_app.sip.breaker.window != 20)
+		vty_out(vty, " circuit-breaker window %u%s", g_app.sip.breaker.window, VTY_NEWLINE);
+	if (g_app.sip.breaker.open_time != 30)
+		vty_out(vty, " circuit-breaker open-time %u%s", g_app.sip.breaker.open_time, VTY_NEWLINE);
+	if (g_app.sip.breaker.probes != 3)
+		vty_out(vty, " circuit-breaker probes %u%s", g_app.sip.breaker.probes, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
 static int config_write_mncc(struct vty *vty)
 {
+	struct mncc_connection *conn;
+	struct mncc_route *route;
+
 	vty_out(vty, "mncc%s", VTY_NEWLINE);
-	vty_out(vty, " socket-path %s%s", g_app.mncc.path, VTY_NEWLINE);
+	llist_for_each_entry(conn, &g_app.mncc.conns, entry)
+		vty_out(vty, " socket-path %s%s", conn->path, VTY_NEWLINE);
+	llist_for_each_entry(route, &g_app.mncc.routes, entry) {
+		if (route->type == MNCC_ROUTE_PREFIX)
+			vty_out(vty, " route prefix %s %s%s", route->first, route->conn->path, VTY_NEWLINE);
+		else
+			vty_out(vty, " route imsi %s %s %s%s", route->first, route->last,
+				route->conn->path, VTY_NEWLINE);
+	}
+	vty_out(vty, " read-budget %d%s", g_app.mncc.read_budget, VTY_NEWLINE);
+	vty_out(vty, " command-timeout %d%s", g_app.mncc.cmd_timeout, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -100,6 +140,16 @@ static int config_write_app(struct vty *vty)
 	vty_out(vty, "app%s", VTY_NEWLINE);
 	if (g_app.use_imsi_as_id)
 		vty_out(vty, " use-imsi%s", VTY_NEWLINE);
+	if (g_app.call_pool_high_water != 256)
+		vty_out(vty, " call-pool high-water %u%s", g_app.call_pool_high_water, VTY_NEWLINE);
+	if (g_app.admission.max_calls)
+		vty_out(vty, " admission max-calls %u%s", g_app.admission.max_calls, VTY_NEWLINE);
+	if (g_app.admission.max_setups)
+		vty_out(vty, " admission max-setups %u%s", g_app.admission.max_setups, VTY_NEWLINE);
+	if (g_app.admission.max_loop_lag)
+		vty_out(vty, " admission max-loop-lag %u%s", g_app.admission.max_loop_lag, VTY_NEWLINE);
+	if (g_app.admission.retry_after != 5)
+		vty_out(vty, " admission retry-after %u%s", g_app.admission.retry_after, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -124,9 +174,65 @@ DEFUN(cfg_sip_remote_addr, cfg_sip_remote_addr_cmd,
 	"remote ADDR <1-65534>",
 	"Remote information\nSIP hostname\nport\n")
 {
-	talloc_free((char *) g_app.sip.remote_addr);
-	g_app.sip.remote_addr = talloc_strdup(tall_mncc_ctx, argv[0]);
-	g_app.sip.remote_port = atoi(argv[1]);
+	struct sip_trunk *trunk;
+
+	trunk = app_sip_trunk_add(&g_app, argv[0], atoi(argv[1]));
+	trunk->weight = 1;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_remote_addr_weight, cfg_sip_remote_addr_weight_cmd,
+	"remote ADDR <1-65534> weight <1-1000>",
+	"Remote information\nSIP hostname\nport\n"
+	"Share of the calls relative to the other remotes\nWeight\n")
+{
+	struct sip_trunk *trunk;
+
+	trunk = app_sip_trunk_add(&g_app, argv[0], atoi(argv[1]));
+	trunk->weight = atoi(argv[2]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_no_remote_addr, cfg_sip_no_remote_addr_cmd,
+	"no remote ADDR <1-65534>",
+	NO_STR "Remote information\nSIP hostname\nport\n")
+{
+	struct sip_trunk *trunk;
+
+	trunk = app_sip_trunk_find(&g_app, argv[0], atoi(argv[1]));
+	if (!trunk) {
+		vty_out(vty, "%% No remote %s %s%s", argv[0], argv[1], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	sip_trunk_free(trunk);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_trunk_selection, cfg_sip_trunk_selection_cmd,
+	"trunk-selection (round-robin|least-calls)",
+	"How calls from the MSC are spread over the remotes\n"
+	"Weighted round-robin\n"
+	"The remote with the fewest calls relative to its weight\n")
+{
+	g_app.sip.trunk_selection = get_string_value(sip_trunk_selection_names, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_options_interval, cfg_sip_options_interval_cmd,
+	"options-interval <0-3600>",
+	"Check the remotes with OPTIONS and leave out the ones not answering\n"
+	"Seconds between the checks, 0 to disable them\n")
+{
+	if (vty->type != VTY_FILE && supervisor_is_running()) {
+		vty_out(vty, "%% The supervisor has no SIP side, change this in the workers%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	g_app.sip.options_interval = atoi(argv[0]);
+	/* health checks from the config file are started by app_setup() */
+	if (vty->type != VTY_FILE)
+		sip_agent_options_start(&g_app.sip.agent);
 	return CMD_SUCCESS;
 }
 
@@ -143,6 +249,62 @@ DEFUN(cfg_sip_sofia_log_level, cfg_sip_sofia_log_level_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_sip_sofia_stack_thread, cfg_sip_sofia_stack_thread_cmd,
+	"sofia-sip stack-thread",
+	"sofia-sip library configuration\n"
+	"Run the SIP stack in a thread of its own (needs a restart)\n")
+{
+	g_app.sip.stack_thread = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_no_sofia_stack_thread, cfg_sip_no_sofia_stack_thread_cmd,
+	"no sofia-sip stack-thread",
+	NO_STR "sofia-sip library configuration\n"
+	"Run the SIP stack in a thread of its own (needs a restart)\n")
+{
+	g_app.sip.stack_thread = false;
+	return CMD_SUCCESS;
+}
+
+#define BREAKER_STR "Stop sending calls to a failing remote\n"
+
+DEFUN(cfg_sip_breaker_failure_percent, cfg_sip_breaker_failure_percent_cmd,
+	"circuit-breaker failure-percent <0-100>",
+	BREAKER_STR "Open at this share of INVITEs failed with 5xx or a timeout\n"
+	"Percent, 0 disables the circuit breaker\n")
+{
+	g_app.sip.breaker.failure_percent = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_breaker_window, cfg_sip_breaker_window_cmd,
+	"circuit-breaker window <1-64>",
+	BREAKER_STR "Number of recent INVITEs the share of failures is taken from\n"
+	"Number of INVITEs\n")
+{
+	g_app.sip.breaker.window = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_breaker_open_time, cfg_sip_breaker_open_time_cmd,
+	"circuit-breaker open-time <1-3600>",
+	BREAKER_STR "Time to reject calls before probing, unless the remote sent a Retry-After\n"
+	"Seconds\n")
+{
+	g_app.sip.breaker.open_time = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_sip_breaker_probes, cfg_sip_breaker_probes_cmd,
+	"circuit-breaker probes <1-16>",
+	BREAKER_STR "Calls let through after the open time, all must succeed to close again\n"
+	"Number of calls\n")
+{
+	g_app.sip.breaker.probes = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mncc, cfg_mncc_cmd,
 	"mncc",
 	"MNCC\n")
@@ -151,12 +313,138 @@ DEFUN(cfg_mncc, cfg_mncc_cmd,
 	return CMD_SUCCESS;
 }
 
+/* The MSCs are multiplexed as configured at the start, see mncc_mux.h */
+static bool refuse_in_supervisor(struct vty *vty)
+{
+	if (vty->type == VTY_FILE || !supervisor_is_running())
+		return false;
+	vty_out(vty, "%% The MNCC connections of the supervisor can not be changed at runtime%s",
+		VTY_NEWLINE);
+	return true;
+}
+
 DEFUN(cfg_mncc_path, cfg_mncc_path_cmd,
         "socket-path NAME",
 	"MNCC filepath\nFilename\n")
 {
-	talloc_free((char *) g_app.mncc.path);
-	g_app.mncc.path = talloc_strdup(tall_mncc_ctx, argv[0]);
+	struct mncc_connection *conn;
+
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+	if (app_mncc_find(&g_app, argv[0]))
+		return CMD_SUCCESS;
+
+	/* connections from the config file are started by app_setup() */
+	conn = app_mncc_add(&g_app, argv[0]);
+	if (g_worker >= 0)
+		conn->mux_path = mncc_mux_path(conn, conn->path);
+	if (vty->type != VTY_FILE)
+		mncc_connection_start(conn);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_no_path, cfg_mncc_no_path_cmd,
+	"no socket-path NAME",
+	NO_STR "MNCC filepath\nFilename\n")
+{
+	struct mncc_connection *conn;
+
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+
+	conn = app_mncc_find(&g_app, argv[0]);
+	if (!conn) {
+		vty_out(vty, "%% No socket-path %s configured%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	/* releases the calls through this MSC and drops its routes */
+	app_mncc_del(&g_app, conn);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_route_prefix, cfg_mncc_route_prefix_cmd,
+	"route prefix PREFIX NAME",
+	"Route calls from SIP to an MSC\nBy prefix of the called number\nNumber prefix\n"
+	"socket-path of the MSC\n")
+{
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+
+	if (app_mncc_route_add(&g_app, MNCC_ROUTE_PREFIX, argv[0], NULL, argv[1]) < 0) {
+		vty_out(vty, "%% No socket-path %s configured%s", argv[1], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_route_imsi, cfg_mncc_route_imsi_cmd,
+	"route imsi FIRST LAST NAME",
+	"Route calls from SIP to an MSC\nBy IMSI range, for use-imsi\nFirst IMSI of the range\n"
+	"Last IMSI of the range\nsocket-path of the MSC\n")
+{
+	size_t len = strlen(argv[0]);
+
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+
+	if (len != strlen(argv[1]) || strspn(argv[0], "0123456789") != len
+	    || strspn(argv[1], "0123456789") != len || strcmp(argv[0], argv[1]) > 0) {
+		vty_out(vty, "%% IMSI range needs two IMSIs of the same length in ascending order%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	if (app_mncc_route_add(&g_app, MNCC_ROUTE_IMSI, argv[0], argv[1], argv[2]) < 0) {
+		vty_out(vty, "%% No socket-path %s configured%s", argv[2], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_no_route_prefix, cfg_mncc_no_route_prefix_cmd,
+	"no route prefix PREFIX NAME",
+	NO_STR "Route calls from SIP to an MSC\nBy prefix of the called number\nNumber prefix\n"
+	"socket-path of the MSC\n")
+{
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+
+	if (app_mncc_route_del(&g_app, MNCC_ROUTE_PREFIX, argv[0], NULL, argv[1]) < 0) {
+		vty_out(vty, "%% No such route%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_no_route_imsi, cfg_mncc_no_route_imsi_cmd,
+	"no route imsi FIRST LAST NAME",
+	NO_STR "Route calls from SIP to an MSC\nBy IMSI range, for use-imsi\nFirst IMSI of the range\n"
+	"Last IMSI of the range\nsocket-path of the MSC\n")
+{
+	if (refuse_in_supervisor(vty))
+		return CMD_WARNING;
+
+	if (app_mncc_route_del(&g_app, MNCC_ROUTE_IMSI, argv[0], argv[1], argv[2]) < 0) {
+		vty_out(vty, "%% No such route%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_read_budget, cfg_mncc_read_budget_cmd,
+	"read-budget <1-1024>",
+	"Messages read from the MNCC socket per wakeup\nNumber of messages\n")
+{
+	g_app.mncc.read_budget = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mncc_cmd_timeout, cfg_mncc_cmd_timeout_cmd,
+	"command-timeout <1-300>",
+	"Time to wait for the MSC to answer an MNCC command\nSeconds\n")
+{
+	g_app.mncc.cmd_timeout = atoi(argv[0]);
 	return CMD_SUCCESS;
 }
 
@@ -183,6 +471,53 @@ DEFUN(cfg_no_use_imsi, cfg_no_use_imsi_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_call_pool_high_water, cfg_call_pool_high_water_cmd,
+	"call-pool high-water <0-65535>",
+	"Pools of preallocated calls and call legs\n"
+	"Number of idle objects kept in each pool\nNumber of objects\n")
+{
+	g_app.call_pool_high_water = atoi(argv[0]);
+	call_pools_resize();
+	return CMD_SUCCESS;
+}
+
+#define ADMISSION_STR "Admission control of new calls\n"
+
+DEFUN(cfg_admission_max_calls, cfg_admission_max_calls_cmd,
+	"admission max-calls <0-65535>",
+	ADMISSION_STR "Reject new calls beyond this many calls\nNumber of calls, 0 for no limit\n")
+{
+	g_app.admission.max_calls = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_admission_max_setups, cfg_admission_max_setups_cmd,
+	"admission max-setups <0-65535>",
+	ADMISSION_STR "Reject new calls beyond this many unanswered calls\nNumber of calls, 0 for no limit\n")
+{
+	g_app.admission.max_setups = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_admission_max_loop_lag, cfg_admission_max_loop_lag_cmd,
+	"admission max-loop-lag <0-10000>",
+	ADMISSION_STR "Reject new calls while the main loop lags behind this much\n"
+	"Milliseconds, 0 for no limit\n")
+{
+	g_app.admission.max_loop_lag = atoi(argv[0]);
+	admission_lag_update();
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_admission_retry_after, cfg_admission_retry_after_cmd,
+	"admission retry-after <0-3600>",
+	ADMISSION_STR "Retry-After of the SIP 503 sent for rejected calls\n"
+	"Seconds, 0 to leave out the header\n")
+{
+	g_app.admission.retry_after = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 static void dump_leg(struct vty *vty, struct call_leg *leg, const char *kind)
 {
 	struct sip_call_leg *sip;
@@ -212,6 +547,7 @@ static void dump_leg(struct vty *vty, struct call_leg *leg, const char *kind)
 				get_value_string(mncc_state_vals, mncc->state), VTY_NEWLINE);
 		vty_out(vty, " MNCC dir(%s)%s",
 				get_value_string(mncc_dir_vals, mncc->dir), VTY_NEWLINE);
+		vty_out(vty, " MNCC socket-path(%s)%s", mncc->conn->path, VTY_NEWLINE);
 		vty_out(vty, " MNCC callref(%u)%s", mncc->callref, VTY_NEWLINE);
 		vty_out(vty, " MNCC called TON(%d) NPI(%d) NUM(%.32s)%s",
 				mncc->called.type, mncc->called.plan, mncc->called.number,
@@ -221,7 +557,7 @@ static void dump_leg(struct vty *vty, struct call_leg *leg, const char *kind)
 				VTY_NEWLINE);
 		vty_out(vty, " MNCC imsi(%.16s)%s", mncc->imsi, VTY_NEWLINE);
 		vty_out(vty, " MNCC timer pending(%d)%s",
-				osmo_timer_pending(&mncc->cmd_timeout), VTY_NEWLINE);
+				timer_wheel_pending(&mncc->cmd_timeout), VTY_NEWLINE);
 		break;
 	default:
 		vty_out(vty, " Unhandled type: %d%s", leg->type, VTY_NEWLINE);
@@ -229,6 +565,25 @@ static void dump_leg(struct vty *vty, struct call_leg *leg, const char *kind)
 	}
 }
 
+/* Setup transitions reached so far, in milliseconds since the setup */
+static void dump_setup_ts(struct vty *vty, const struct call *call)
+{
+	const struct timespec *start = &call->setup_ts[CALL_TS_SETUP];
+	int ts;
+
+	vty_out(vty, " Setup");
+	for (ts = CALL_TS_SETUP + 1; ts < _NUM_CALL_TS; ++ts) {
+		const struct timespec *stamp = &call->setup_ts[ts];
+
+		if (!call_stamped(call, ts))
+			continue;
+		vty_out(vty, " %s(+%ldms)", get_value_string(call_setup_ts_names, ts),
+			(long) ((stamp->tv_sec - start->tv_sec) * 1000 +
+				(stamp->tv_nsec - start->tv_nsec) / 1000000));
+	}
+	vty_out(vty, "%s", VTY_NEWLINE);
+}
+
 DEFUN(show_calls, show_calls_cmd,
 	"show calls",
 	SHOW_STR "Current calls\n")
@@ -238,6 +593,7 @@ DEFUN(show_calls, show_calls_cmd,
 	llist_for_each_entry(call, &g_call_list, entry) {
 		vty_out(vty, "Call(%u) from %s to %s%s",
 			call->id, call->source, call->dest, VTY_NEWLINE);
+		dump_setup_ts(vty, call);
 		dump_leg(vty, call->initial, "Initial");
 		dump_leg(vty, call->remote, "Remote");
 	}
@@ -282,25 +638,227 @@ DEFUN(show_calls_sum, show_calls_sum_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_call_pools, show_call_pools_cmd,
+	"show call-pools",
+	SHOW_STR "Pools of preallocated calls and call legs\n")
+{
+	int i;
+
+	vty_out(vty, "Pool           Size  In use  Peak    Idle    Hits       Misses%s", VTY_NEWLINE);
+	vty_out(vty, "------------- ----- ------- ------- ------- ---------- ----------%s", VTY_NEWLINE);
+
+	for (i = 0; i < ARRAY_SIZE(g_call_pools); ++i) {
+		struct call_pool *pool = &g_call_pools[i];
+		vty_out(vty, "%-13s %5zu %7u %7u %7u %10llu %10llu%s",
+			pool->name, pool->size, pool->in_use, pool->peak, pool->idle,
+			pool->hits, pool->misses, VTY_NEWLINE);
+	}
+	vty_out(vty, "High-water mark: %u%s", g_app.call_pool_high_water, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_latency, show_latency_cmd,
+	"show latency",
+	SHOW_STR "Time spent handling MNCC messages and SIP events, and call setup delays\n")
+{
+	int i, j, b;
+
+	for (i = 0; i < ARRAY_SIZE(g_latency); ++i) {
+		struct latency_stats *stats = &g_latency[i];
+
+		vty_out(vty, "%s handling time in microseconds:%s", stats->name, VTY_NEWLINE);
+		vty_out(vty, "%-22s %9s %7s %7s", "Type", "Count", "Avg", "Max");
+		for (b = 0; b < ARRAY_SIZE(latency_bucket_us); ++b)
+			vty_out(vty, " <=%-6u", latency_bucket_us[b]);
+		vty_out(vty, " >%-7u%s", latency_bucket_us[b - 1], VTY_NEWLINE);
+
+		for (j = 0; j < stats->num_hists; ++j) {
+			struct latency_hist *hist = &stats->hists[j];
+
+			vty_out(vty, "%-22s %9llu %7llu %7u", stats->type_name(hist->type),
+				(unsigned long long) hist->count,
+				(unsigned long long) (hist->total_us / hist->count), hist->max_us);
+			for (b = 0; b < ARRAY_SIZE(hist->buckets); ++b)
+				vty_out(vty, " %8llu", (unsigned long long) hist->buckets[b]);
+			vty_out(vty, "%s", VTY_NEWLINE);
+		}
+		vty_out(vty, "%s", VTY_NEWLINE);
+	}
+
+	vty_out(vty, "Call setup delays in milliseconds:%s", VTY_NEWLINE);
+	vty_out(vty, "%-22s %9s %7s %7s", "Delay", "Count", "Avg", "Max");
+	for (b = 0; b < ARRAY_SIZE(setup_delay_bucket_ms); ++b)
+		vty_out(vty, " <=%-6u", setup_delay_bucket_ms[b]);
+	vty_out(vty, " >%-7u%s", setup_delay_bucket_ms[b - 1], VTY_NEWLINE);
+
+	for (i = 0; i < ARRAY_SIZE(g_setup_delay); ++i) {
+		struct setup_delay_hist *hist = &g_setup_delay[i];
+
+		vty_out(vty, "%-22s %9llu %7llu %7u", hist->name,
+			(unsigned long long) hist->count,
+			(unsigned long long) (hist->count ? hist->total_ms / hist->count : 0), hist->max_ms);
+		for (b = 0; b < ARRAY_SIZE(hist->buckets); ++b)
+			vty_out(vty, " %8llu", (unsigned long long) hist->buckets[b]);
+		vty_out(vty, "%s", VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
 DEFUN(show_mncc_conn, show_mncc_conn_cmd,
 	"show mncc-connection",
 	SHOW_STR "MNCC Connection state\n")
 {
-	vty_out(vty, "MNCC connection to path '%s' is in state %s%s",
-		g_app.mncc.path,
-		get_value_string(mncc_conn_state_vals, g_app.mncc.conn.state),
+	struct mncc_connection *conn;
+
+	llist_for_each_entry(conn, &g_app.mncc.conns, entry) {
+		vty_out(vty, "MNCC connection to path '%s' is in state %s%s",
+			conn->path,
+			get_value_string(mncc_conn_state_vals, conn->state),
+			VTY_NEWLINE);
+		vty_out(vty, "MNCC tx queue holds %u messages%s",
+			conn->tx_queue_len, VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
+static void dump_admission_limit(struct vty *vty, const char *name, unsigned int current,
+				 unsigned int limit, enum admission_result result)
+{
+	if (limit)
+		vty_out(vty, "%-14s %7u %7u %10llu%s", name, current, limit,
+			(unsigned long long) admission_count(result), VTY_NEWLINE);
+	else
+		vty_out(vty, "%-14s %7u %7s %10llu%s", name, current, "-",
+			(unsigned long long) admission_count(result), VTY_NEWLINE);
+}
+
+DEFUN(show_admission, show_admission_cmd,
+	"show admission",
+	SHOW_STR "Admission control of new calls\n")
+{
+	const struct admission_config *cfg = &g_app.admission;
+
+	vty_out(vty, "Limit          Current   Limit   Rejected%s", VTY_NEWLINE);
+	vty_out(vty, "-------------- ------- ------- ----------%s", VTY_NEWLINE);
+	dump_admission_limit(vty, "calls", g_call_pools[CALL_POOL_CALL].in_use,
+			     cfg->max_calls, ADMISSION_MAX_CALLS);
+	dump_admission_limit(vty, "setups", g_calls_in_setup,
+			     cfg->max_setups, ADMISSION_MAX_SETUPS);
+	dump_admission_limit(vty, "loop-lag (ms)", admission_loop_lag(),
+			     cfg->max_loop_lag, ADMISSION_LOOP_LAG);
+	vty_out(vty, "Admitted: %llu%s",
+		(unsigned long long) admission_count(ADMISSION_OK), VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_sip_trunks, show_sip_trunks_cmd,
+	"show sip trunks",
+	SHOW_STR "SIP related information\nRemotes calls from the MSC are sent to\n")
+{
+	struct sip_trunk *trunk;
+
+	vty_out(vty, "Remote                       Weight   Calls Health   RTT(ms)  Avg(ms) Breaker%s", VTY_NEWLINE);
+	vty_out(vty, "---------------------------- ------ ------- -------- ------- -------- ---------%s", VTY_NEWLINE);
+
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		char remote[64];
+		const char *health = "-";
+
+		snprintf(remote, sizeof(remote), "%s:%d", trunk->addr, trunk->port);
+		if (g_app.sip.options_interval)
+			health = trunk->down ? "down" : "up";
+		vty_out(vty, "%-28s %6u %7u %-8s %7u %8u %s%s", remote, trunk->weight,
+			trunk->active_calls, health, trunk->rtt_last, trunk->rtt_avg,
+			g_app.sip.breaker.failure_percent
+				? get_value_string(breaker_state_names, trunk->breaker.state) : "-",
+			VTY_NEWLINE);
+	}
+	vty_out(vty, "Selection: %s%s",
+		get_value_string(sip_trunk_selection_names, g_app.sip.trunk_selection), VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_circuit_breaker, show_circuit_breaker_cmd,
+	"show circuit-breaker",
+	SHOW_STR "Circuit breakers of the SIP remotes\n")
+{
+	struct sip_trunk *trunk;
+
+	if (!g_app.sip.breaker.failure_percent) {
+		vty_out(vty, "Circuit breaker is disabled%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	llist_for_each_entry(trunk, &g_app.sip.trunks, entry) {
+		const struct circuit_breaker *breaker = &trunk->breaker;
+
+		vty_out(vty, "Remote %s:%d%s", trunk->addr, trunk->port, VTY_NEWLINE);
+		vty_out(vty, " State: %s%s", get_value_string(breaker_state_names, breaker->state), VTY_NEWLINE);
+		if (breaker->state == BREAKER_CLOSED)
+			vty_out(vty, " Failed INVITEs: %u of %u%s", breaker_failures(breaker),
+				breaker->num_outcomes, VTY_NEWLINE);
+		else
+			vty_out(vty, " Opened by status: %d, probes sent: %u, succeeded: %u%s",
+				breaker->open_status, breaker->probes_sent, breaker->probes_ok, VTY_NEWLINE);
+		vty_out(vty, " Opened: %llu, calls rejected: %llu%s", breaker->opened, breaker->rejected,
+			VTY_NEWLINE);
+	}
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_workers, show_workers_cmd,
+	"show workers",
+	SHOW_STR "Worker processes of the supervisor\n")
+{
+	struct worker_stats total = { 0, };
+	unsigned int i;
+
+	if (!g_num_workers) {
+		vty_out(vty, "Not running with workers%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+
+	vty_out(vty, "Worker Pid     Restarts SIP   VTY   Calls   Setups  MO att/conn      MT att/conn      Rejected%s",
 		VTY_NEWLINE);
+	for (i = 0; i < g_num_workers; ++i) {
+		const struct worker_stats *w = &g_worker_stats[i];
+
+		vty_out(vty, "%-6u %-7d %8u %-5d %-5d %7u %7u %8llu/%-7llu %8llu/%-7llu %8llu%s",
+			i, (int) w->pid, w->restarts, w->sip_port, w->vty_port, w->calls, w->setups,
+			(unsigned long long) w->mo_attempts, (unsigned long long) w->mo_connects,
+			(unsigned long long) w->mt_attempts, (unsigned long long) w->mt_connects,
+			(unsigned long long) w->rejected, VTY_NEWLINE);
+		total.calls += w->calls;
+		total.setups += w->setups;
+		total.mo_attempts += w->mo_attempts;
+		total.mo_connects += w->mo_connects;
+		total.mt_attempts += w->mt_attempts;
+		total.mt_connects += w->mt_connects;
+		total.rejected += w->rejected;
+	}
+	vty_out(vty, "%-38s %7u %7u %8llu/%-7llu %8llu/%-7llu %8llu%s", "Total",
+		total.calls, total.setups,
+		(unsigned long long) total.mo_attempts, (unsigned long long) total.mo_connects,
+		(unsigned long long) total.mt_attempts, (unsigned long long) total.mt_connects,
+		(unsigned long long) total.rejected, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
 void mncc_sip_vty_init(void)
 {
 	/* default values */
-	g_app.mncc.path = talloc_strdup(tall_mncc_ctx, "/tmp/msc_mncc");
+	INIT_LLIST_HEAD(&g_app.mncc.conns);
+	INIT_LLIST_HEAD(&g_app.mncc.routes);
+	g_app.mncc.read_budget = 32;
+	g_app.mncc.cmd_timeout = 5;
 	g_app.sip.local_addr = talloc_strdup(tall_mncc_ctx, "127.0.0.1");
 	g_app.sip.local_port = 5060;
-	g_app.sip.remote_addr = talloc_strdup(tall_mncc_ctx, "pbx");
-	g_app.sip.remote_port = 5060;
+	INIT_LLIST_HEAD(&g_app.sip.trunks);
+	g_app.sip.breaker.window = 20;
+	g_app.sip.breaker.open_time = 30;
+	g_app.sip.breaker.probes = 3;
+	g_app.call_pool_high_water = 256;
+	g_app.admission.retry_after = 5;
 
 
 	vty_init(&vty_info);
@@ -309,18 +867,46 @@ void mncc_sip_vty_init(void)
 	install_node(&sip_node, config_write_sip);
 	install_element(SIP_NODE, &cfg_sip_local_addr_cmd);
 	install_element(SIP_NODE, &cfg_sip_remote_addr_cmd);
+	install_element(SIP_NODE, &cfg_sip_remote_addr_weight_cmd);
+	install_element(SIP_NODE, &cfg_sip_no_remote_addr_cmd);
+	install_element(SIP_NODE, &cfg_sip_trunk_selection_cmd);
+	install_element(SIP_NODE, &cfg_sip_options_interval_cmd);
 	install_element(SIP_NODE, &cfg_sip_sofia_log_level_cmd);
+	install_element(SIP_NODE, &cfg_sip_sofia_stack_thread_cmd);
+	install_element(SIP_NODE, &cfg_sip_no_sofia_stack_thread_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_failure_percent_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_window_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_open_time_cmd);
+	install_element(SIP_NODE, &cfg_sip_breaker_probes_cmd);
 
 	install_element(CONFIG_NODE, &cfg_mncc_cmd);
 	install_node(&mncc_node, config_write_mncc);
 	install_element(MNCC_NODE, &cfg_mncc_path_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_route_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_route_imsi_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_path_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_route_prefix_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_no_route_imsi_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_read_budget_cmd);
+	install_element(MNCC_NODE, &cfg_mncc_cmd_timeout_cmd);
 
 	install_element(CONFIG_NODE, &cfg_app_cmd);
 	install_node(&app_node, config_write_app);
 	install_element(APP_NODE, &cfg_use_imsi_cmd);
 	install_element(APP_NODE, &cfg_no_use_imsi_cmd);
+	install_element(APP_NODE, &cfg_call_pool_high_water_cmd);
+	install_element(APP_NODE, &cfg_admission_max_calls_cmd);
+	install_element(APP_NODE, &cfg_admission_max_setups_cmd);
+	install_element(APP_NODE, &cfg_admission_max_loop_lag_cmd);
+	install_element(APP_NODE, &cfg_admission_retry_after_cmd);
 
 	install_element_ve(&show_calls_cmd);
 	install_element_ve(&show_calls_sum_cmd);
 	install_element_ve(&show_mncc_conn_cmd);
+	install_element_ve(&show_call_pools_cmd);
+	install_element_ve(&show_latency_cmd);
+	install_element_ve(&show_admission_cmd);
+	install_element_ve(&show_sip_trunks_cmd);
+	install_element_ve(&show_circuit_breaker_cmd);
+	install_element_ve(&show_workers_cmd);
 }
@@ -0,0 +1,1033 @@
+/*
+ * Load generator for osmo-sip-connector
+ *
+ * Acts as the MSC on the MNCC socket and as a SIP UAS on the trunk side,
+ * originates MO calls at a configurable rate and measures how long the
+ * connector takes to set them up.
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "mncc_protocol.h"
+
+#include <osmocom/gsm/protocol/gsm_03_40.h>
+
+#include <osmocom/core/hashtable.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/socket.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/* SDP of the MS side, kept small so the INVITE fits into one UDP datagram */
+#define LOAD_MNCC_SDP \
+	"v=0\r\n" \
+	"o=OsmoMSC 0 0 IN IP4 127.0.0.1\r\n" \
+	"s=GSM Call\r\n" \
+	"c=IN IP4 127.0.0.1\r\n" \
+	"t=0 0\r\n" \
+	"m=audio 4000 RTP/AVP 3\r\n" \
+	"a=rtpmap:3 GSM/8000\r\n" \
+	"a=sendrecv\r\n"
+
+#define LOAD_SIP_SDP \
+	"v=0\r\n" \
+	"o=uas 0 0 IN IP4 %s\r\n" \
+	"s=load\r\n" \
+	"c=IN IP4 %s\r\n" \
+	"t=0 0\r\n" \
+	"m=audio %u RTP/AVP 3\r\n" \
+	"a=rtpmap:3 GSM/8000\r\n" \
+	"a=sendrecv\r\n"
+
+/* generator tick, the number of new calls is derived from the elapsed time */
+#define LOAD_TICK_US		1000
+
+enum load_release {
+	LOAD_RELEASE_MSC,
+	LOAD_RELEASE_SIP,
+	LOAD_RELEASE_MIXED,
+};
+
+static const struct value_string load_release_names[] = {
+	{ LOAD_RELEASE_MSC,	"msc" },
+	{ LOAD_RELEASE_SIP,	"sip" },
+	{ LOAD_RELEASE_MIXED,	"mixed" },
+	{ 0, NULL },
+};
+
+enum load_call_state {
+	LOAD_CALL_SETUP,
+	LOAD_CALL_CONNECTED,
+	LOAD_CALL_RELEASING,
+};
+
+struct load_call {
+	struct hlist_node entry;
+	uint32_t callref;
+	enum load_call_state state;
+	bool failed;
+	double setup_start;
+
+	/* answer delay, hold time and setup timeout */
+	struct osmo_timer_list timer;
+
+	/* SIP dialog, filled in once the INVITE arrived */
+	struct sockaddr_storage sip_peer;
+	socklen_t sip_peer_len;
+	char *sip_rsp_hdrs;
+	char *sip_contact;
+	char *sip_from;
+	char *sip_to;
+	char *sip_call_id;
+};
+
+struct load_stats {
+	unsigned int attempts;
+	unsigned int ok;
+	unsigned int failed;
+	double *latency;
+	unsigned int latency_len;
+	unsigned int latency_size;
+};
+
+static struct {
+	/* configuration */
+	const char *mncc_path;
+	const char *sip_addr;
+	int sip_port;
+	double rate;
+	double ramp_step;
+	unsigned int duration;
+	unsigned int interval;
+	unsigned int hold_ms;
+	unsigned int answer_ms;
+	unsigned int setup_timeout;
+	unsigned int max_calls;
+	double max_p99;
+	double max_fail_ratio;
+	enum load_release release;
+
+	struct osmo_fd mncc_listen;
+	struct osmo_fd mncc;
+	struct osmo_fd sip;
+	struct osmo_timer_list tick;
+
+	DECLARE_HASHTABLE(calls, 12);
+	unsigned int active;
+	uint32_t next_callref;
+
+	double start;
+	double phase_start;
+	unsigned long phase_sent;
+	double interval_start;
+	bool generating;
+	bool quit;
+
+	struct load_stats interval_stats;
+	struct load_stats total;
+	double max_sustained;
+} g_load = {
+	.mncc_path = "/tmp/msc_mncc",
+	.sip_addr = "127.0.0.1",
+	.sip_port = 5060,
+	.rate = 10,
+	.duration = 60,
+	.interval = 5,
+	.hold_ms = 1000,
+	.setup_timeout = 10,
+	.max_calls = 10000,
+	.max_p99 = 500,
+	.max_fail_ratio = 0.01,
+	.release = LOAD_RELEASE_MSC,
+	.next_callref = 1,
+};
+
+static void *tall_load_ctx;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Statistics
+ */
+static void stats_add_latency(struct load_stats *stats, double latency)
+{
+	if (stats->latency_len == stats->latency_size) {
+		stats->latency_size = stats->latency_size ? stats->latency_size * 2 : 1024;
+		stats->latency = talloc_realloc(tall_load_ctx, stats->latency, double, stats->latency_size);
+		OSMO_ASSERT(stats->latency);
+	}
+	stats->latency[stats->latency_len++] = latency;
+}
+
+static int cmp_double(const void *_a, const void *_b)
+{
+	double a = *(const double *) _a, b = *(const double *) _b;
+
+	return a < b ? -1 : a > b;
+}
+
+/* sorts the samples */
+static double stats_percentile(struct load_stats *stats, double pct)
+{
+	unsigned int idx;
+
+	if (!stats->latency_len)
+		return 0;
+
+	qsort(stats->latency, stats->latency_len, sizeof(double), cmp_double);
+	idx = (unsigned int) (pct / 100.0 * (stats->latency_len - 1) + 0.5);
+	return stats->latency[idx];
+}
+
+static void stats_print(const char *label, struct load_stats *stats, double secs)
+{
+	printf("%-10s attempts %7u ok %7u failed %6u active %6u caps %8.1f  "
+	       "p50 %8.2f p90 %8.2f p99 %8.2f max %8.2f ms\n",
+	       label, stats->attempts, stats->ok, stats->failed, g_load.active,
+	       secs > 0 ? stats->ok / secs : 0.0,
+	       stats_percentile(stats, 50), stats_percentile(stats, 90),
+	       stats_percentile(stats, 99), stats_percentile(stats, 100));
+	fflush(stdout);
+}
+
+/* An interval holds if few calls failed and setup was fast enough */
+static bool stats_holds(struct load_stats *stats)
+{
+	unsigned int done = stats->ok + stats->failed;
+
+	if (!done)
+		return false;
+	if ((double) stats->failed / done > g_load.max_fail_ratio)
+		return false;
+	return stats_percentile(stats, 99) <= g_load.max_p99;
+}
+
+/*
+ * Call table
+ */
+static struct load_call *call_find(uint32_t callref)
+{
+	struct load_call *call;
+
+	hash_for_each_possible(g_load.calls, call, entry, callref) {
+		if (call->callref == callref)
+			return call;
+	}
+	return NULL;
+}
+
+static void call_free(struct load_call *call)
+{
+	osmo_timer_del(&call->timer);
+	hash_del(&call->entry);
+	g_load.active -= 1;
+	talloc_free(call);
+}
+
+static void call_failed(struct load_call *call)
+{
+	if (call->failed || call->state != LOAD_CALL_SETUP)
+		return;
+	call->failed = true;
+	g_load.interval_stats.failed += 1;
+	g_load.total.failed += 1;
+}
+
+static void call_done(struct load_call *call)
+{
+	call_failed(call);
+	call_free(call);
+}
+
+/*
+ * MNCC side, the fake MSC
+ */
+static void mncc_send_msg(const void *msg, size_t len)
+{
+	if (g_load.mncc.fd < 0)
+		return;
+	if (send(g_load.mncc.fd, msg, len, 0) != len)
+		fprintf(stderr, "Failed to send MNCC message: %s\n", strerror(errno));
+}
+
+static void mncc_send_simple(uint32_t msg_type, uint32_t callref)
+{
+	struct gsm_mncc mncc = { 0, };
+
+	mncc.msg_type = msg_type;
+	mncc.callref = callref;
+	mncc_send_msg(&mncc, sizeof(mncc));
+}
+
+static void mncc_send_disc_ind(struct load_call *call)
+{
+	struct gsm_mncc mncc = { 0, };
+
+	mncc.msg_type = MNCC_DISC_IND;
+	mncc.callref = call->callref;
+	mncc.fields |= MNCC_F_CAUSE;
+	mncc.cause.coding = GSM48_CAUSE_CODING_GSM;
+	mncc.cause.location = GSM48_CAUSE_LOC_USER;
+	mncc.cause.value = GSM48_CC_CAUSE_NORM_CALL_CLEAR;
+	mncc_send_msg(&mncc, sizeof(mncc));
+}
+
+static void mncc_send_hello(void)
+{
+	struct gsm_mncc_hello hello = { 0, };
+
+	hello.msg_type = MNCC_SOCKET_HELLO;
+	hello.version = MNCC_SOCK_VERSION;
+	hello.mncc_size = sizeof(struct gsm_mncc);
+	hello.data_frame_size = sizeof(struct gsm_data_frame);
+	hello.called_offset = offsetof(struct gsm_mncc, called);
+	hello.signal_offset = offsetof(struct gsm_mncc, signal);
+	hello.emergency_offset = offsetof(struct gsm_mncc, emergency);
+	hello.lchan_type_offset = offsetof(struct gsm_mncc, lchan_type);
+	mncc_send_msg(&hello, sizeof(hello));
+}
+
+static void sip_send_bye(struct load_call *call);
+
+static void call_timeout(void *data)
+{
+	struct load_call *call = data;
+
+	switch (call->state) {
+	case LOAD_CALL_SETUP:
+		fprintf(stderr, "call(%u) setup timed out\n", call->callref);
+		call_failed(call);
+		call->state = LOAD_CALL_RELEASING;
+		mncc_send_disc_ind(call);
+		break;
+	case LOAD_CALL_CONNECTED:
+		call->state = LOAD_CALL_RELEASING;
+		if (g_load.release == LOAD_RELEASE_SIP
+		    || (g_load.release == LOAD_RELEASE_MIXED && (call->callref & 1)))
+			sip_send_bye(call);
+		else
+			mncc_send_disc_ind(call);
+		break;
+	case LOAD_CALL_RELEASING:
+		/* the connector did not finish the release, give up on it */
+		fprintf(stderr, "call(%u) release timed out\n", call->callref);
+		call_free(call);
+		return;
+	}
+
+	/* guard the release */
+	if (call->state == LOAD_CALL_RELEASING)
+		osmo_timer_schedule(&call->timer, g_load.setup_timeout, 0);
+}
+
+static void call_start(void)
+{
+	struct gsm_mncc mncc = { 0, };
+	struct load_call *call;
+
+	call = talloc_zero(tall_load_ctx, struct load_call);
+	OSMO_ASSERT(call);
+	call->callref = g_load.next_callref++;
+	call->state = LOAD_CALL_SETUP;
+	call->setup_start = now_ms();
+	osmo_timer_setup(&call->timer, call_timeout, call);
+	osmo_timer_schedule(&call->timer, g_load.setup_timeout, 0);
+	hash_add(g_load.calls, &call->entry, call->callref);
+	g_load.active += 1;
+	g_load.interval_stats.attempts += 1;
+	g_load.total.attempts += 1;
+
+	mncc.msg_type = MNCC_SETUP_IND;
+	mncc.callref = call->callref;
+	mncc.fields = MNCC_F_CALLED | MNCC_F_CALLING;
+	mncc.called.plan = GSM340_PLAN_ISDN;
+	snprintf(mncc.called.number, sizeof(mncc.called.number), "%u", call->callref);
+	mncc.calling.plan = GSM340_PLAN_ISDN;
+	snprintf(mncc.calling.number, sizeof(mncc.calling.number), "1%09u", call->callref);
+	snprintf(mncc.imsi, sizeof(mncc.imsi), "90170%010u", call->callref);
+	OSMO_STRLCPY_ARRAY(mncc.sdp, LOAD_MNCC_SDP);
+	mncc_send_msg(&mncc, sizeof(mncc));
+}
+
+static void mncc_rx_rtp_create(const struct gsm_mncc_rtp *req)
+{
+	struct gsm_mncc_rtp rtp = { 0, };
+	struct sockaddr_in *sin = (struct sockaddr_in *) &rtp.addr;
+
+	rtp.msg_type = MNCC_RTP_CREATE;
+	rtp.callref = req->callref;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin->sin_port = htons(4000);
+	rtp.payload_type = 3;
+	rtp.payload_msg_type = GSM_TCHF_FRAME;
+	OSMO_STRLCPY_ARRAY(rtp.sdp, LOAD_MNCC_SDP);
+	mncc_send_msg(&rtp, sizeof(rtp));
+}
+
+static void mncc_rx_setup_rsp(struct load_call *call)
+{
+	double latency;
+
+	if (call->state != LOAD_CALL_SETUP)
+		return;
+
+	latency = now_ms() - call->setup_start;
+	stats_add_latency(&g_load.interval_stats, latency);
+	stats_add_latency(&g_load.total, latency);
+	g_load.interval_stats.ok += 1;
+	g_load.total.ok += 1;
+
+	call->state = LOAD_CALL_CONNECTED;
+	mncc_send_simple(MNCC_SETUP_COMPL_IND, call->callref);
+	osmo_timer_schedule(&call->timer, g_load.hold_ms / 1000, (g_load.hold_ms % 1000) * 1000);
+}
+
+static void mncc_rx(const char *buf, int len)
+{
+	const struct gsm_mncc *mncc = (const struct gsm_mncc *) buf;
+	struct load_call *call;
+
+	if (len < sizeof(struct gsm_data_frame)) {
+		fprintf(stderr, "Short MNCC message of %d bytes\n", len);
+		return;
+	}
+
+	if (mncc->msg_type == MNCC_RTP_CREATE) {
+		if (len >= sizeof(struct gsm_mncc_rtp))
+			mncc_rx_rtp_create((const struct gsm_mncc_rtp *) buf);
+		return;
+	}
+
+	call = call_find(mncc->callref);
+	if (!call)
+		return;
+
+	switch (mncc->msg_type) {
+	case MNCC_SETUP_RSP:
+		mncc_rx_setup_rsp(call);
+		break;
+	case MNCC_REJ_REQ:
+		call_done(call);
+		break;
+	case MNCC_DISC_REQ:
+		mncc_send_simple(MNCC_REL_IND, call->callref);
+		call_done(call);
+		break;
+	case MNCC_REL_REQ:
+		mncc_send_simple(MNCC_REL_CNF, call->callref);
+		call_done(call);
+		break;
+	default:
+		/* MNCC_CALL_PROC_REQ, MNCC_ALERT_REQ, MNCC_RTP_CONNECT, ... */
+		break;
+	}
+}
+
+static int mncc_data(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[4096];
+	int rc;
+
+	rc = recv(fd->fd, buf, sizeof(buf), 0);
+	if (rc <= 0) {
+		fprintf(stderr, "MNCC connection closed\n");
+		osmo_fd_unregister(fd);
+		close(fd->fd);
+		fd->fd = -1;
+		g_load.quit = true;
+		return 0;
+	}
+
+	mncc_rx(buf, rc);
+	return 0;
+}
+
+static void generator_start(void);
+
+static int mncc_accept(struct osmo_fd *fd, unsigned int what)
+{
+	int rc;
+
+	rc = accept(fd->fd, NULL, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to accept MNCC connection: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (g_load.mncc.fd >= 0) {
+		fprintf(stderr, "Already connected, rejecting second MNCC connection\n");
+		close(rc);
+		return 0;
+	}
+
+	osmo_fd_setup(&g_load.mncc, rc, OSMO_FD_READ, mncc_data, NULL, 0);
+	osmo_fd_register(&g_load.mncc);
+	printf("MNCC connection established, starting load\n");
+	mncc_send_hello();
+	generator_start();
+	return 0;
+}
+
+/*
+ * SIP side, a minimal UAS answering every INVITE
+ */
+struct sip_msg {
+	char *start_line;
+	char *body;
+	/* header lines in the order received, as "Name: value" */
+	char *hdrs[32];
+	int num_hdrs;
+};
+
+static const struct {
+	const char *name;
+	const char *compact;
+} sip_hdr_names[] = {
+	{ "Via",		"v" },
+	{ "From",		"f" },
+	{ "To",			"t" },
+	{ "Call-ID",		"i" },
+	{ "CSeq",		NULL },
+	{ "Contact",		"m" },
+};
+
+/* Parse 'buf' in place. Header names are expanded from their compact form. */
+static bool sip_parse(char *buf, struct sip_msg *msg)
+{
+	char *line, *next;
+
+	memset(msg, 0, sizeof(*msg));
+	for (line = buf; line && *line; line = next) {
+		next = strstr(line, "\r\n");
+		if (!next)
+			return false;
+		*next = '\0';
+		next += 2;
+
+		if (!msg->start_line) {
+			msg->start_line = line;
+			continue;
+		}
+		if (!*line) {
+			msg->body = next;
+			return true;
+		}
+		if (msg->num_hdrs < ARRAY_SIZE(msg->hdrs))
+			msg->hdrs[msg->num_hdrs++] = line;
+	}
+	return msg->start_line != NULL;
+}
+
+static bool sip_hdr_is(const char *line, const char *name)
+{
+	size_t len = strcspn(line, " \t:");
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sip_hdr_names); ++i) {
+		if (strcasecmp(sip_hdr_names[i].name, name) != 0)
+			continue;
+		if (len == strlen(name) && strncasecmp(line, name, len) == 0)
+			return true;
+		return sip_hdr_names[i].compact && len == 1 && strncasecmp(line, sip_hdr_names[i].compact, 1) == 0;
+	}
+	return false;
+}
+
+static const char *sip_hdr_value(const char *line)
+{
+	line = strchr(line, ':');
+	if (!line)
+		return "";
+	line += 1;
+	while (*line == ' ' || *line == '\t')
+		line += 1;
+	return line;
+}
+
+static const char *sip_hdr(const struct sip_msg *msg, const char *name)
+{
+	int i;
+
+	for (i = 0; i < msg->num_hdrs; ++i) {
+		if (sip_hdr_is(msg->hdrs[i], name))
+			return sip_hdr_value(msg->hdrs[i]);
+	}
+	return NULL;
+}
+
+/* Via, From, To, Call-ID and CSeq of a request, as needed for its responses */
+static char *sip_rsp_hdrs(void *ctx, const struct sip_msg *msg, const char *to_tag)
+{
+	char *hdrs = talloc_strdup(ctx, "");
+	int i;
+
+	for (i = 0; i < msg->num_hdrs; ++i) {
+		const char *line = msg->hdrs[i];
+
+		if (sip_hdr_is(line, "Via"))
+			hdrs = talloc_asprintf_append(hdrs, "Via: %s\r\n", sip_hdr_value(line));
+		else if (sip_hdr_is(line, "From"))
+			hdrs = talloc_asprintf_append(hdrs, "From: %s\r\n", sip_hdr_value(line));
+		else if (sip_hdr_is(line, "To"))
+			hdrs = talloc_asprintf_append(hdrs, "To: %s%s%s\r\n", sip_hdr_value(line),
+						      to_tag && !strstr(line, ";tag=") ? ";tag=" : "",
+						      to_tag && !strstr(line, ";tag=") ? to_tag : "");
+		else if (sip_hdr_is(line, "Call-ID"))
+			hdrs = talloc_asprintf_append(hdrs, "Call-ID: %s\r\n", sip_hdr_value(line));
+		else if (sip_hdr_is(line, "CSeq"))
+			hdrs = talloc_asprintf_append(hdrs, "CSeq: %s\r\n", sip_hdr_value(line));
+	}
+	return hdrs;
+}
+
+static void sip_sendto(const char *data, const struct sockaddr_storage *peer, socklen_t peer_len)
+{
+	if (sendto(g_load.sip.fd, data, strlen(data), 0, (const struct sockaddr *) peer, peer_len) < 0)
+		fprintf(stderr, "Failed to send SIP message: %s\n", strerror(errno));
+}
+
+static void sip_respond(const char *status, const char *hdrs, const char *body,
+			const struct sockaddr_storage *peer, socklen_t peer_len)
+{
+	char *msg;
+
+	if (body)
+		msg = talloc_asprintf(tall_load_ctx,
+				      "SIP/2.0 %s\r\n"
+				      "%s"
+				      "Contact: <sip:uas@%s:%d>\r\n"
+				      "Content-Type: application/sdp\r\n"
+				      "Content-Length: %zu\r\n"
+				      "\r\n"
+				      "%s",
+				      status, hdrs, g_load.sip_addr, g_load.sip_port, strlen(body), body);
+	else
+		msg = talloc_asprintf(tall_load_ctx,
+				      "SIP/2.0 %s\r\n"
+				      "%s"
+				      "Content-Length: 0\r\n"
+				      "\r\n",
+				      status, hdrs);
+	sip_sendto(msg, peer, peer_len);
+	talloc_free(msg);
+}
+
+static void sip_answer(struct load_call *call)
+{
+	char *sdp;
+
+	sdp = talloc_asprintf(call, LOAD_SIP_SDP, g_load.sip_addr, g_load.sip_addr, 10000 + (call->callref % 20000) * 2);
+	sip_respond("200 OK", call->sip_rsp_hdrs, sdp, &call->sip_peer, call->sip_peer_len);
+	talloc_free(sdp);
+}
+
+static void answer_timeout(void *data)
+{
+	struct load_call *call = data;
+
+	sip_answer(call);
+	osmo_timer_setup(&call->timer, call_timeout, call);
+	osmo_timer_schedule(&call->timer, g_load.setup_timeout, 0);
+}
+
+static void sip_send_bye(struct load_call *call)
+{
+	char *msg;
+
+	if (!call->sip_contact) {
+		mncc_send_disc_ind(call);
+		return;
+	}
+
+	/* in-dialog request of the UAS: From and To swap roles */
+	msg = talloc_asprintf(call,
+			      "BYE %s SIP/2.0\r\n"
+			      "Via: SIP/2.0/UDP %s:%d;branch=z9hG4bK-load-%u-%ld;rport\r\n"
+			      "Max-Forwards: 70\r\n"
+			      "From: %s\r\n"
+			      "To: %s\r\n"
+			      "Call-ID: %s\r\n"
+			      "CSeq: 1 BYE\r\n"
+			      "Content-Length: 0\r\n"
+			      "\r\n",
+			      call->sip_contact, g_load.sip_addr, g_load.sip_port, call->callref, random(),
+			      call->sip_to, call->sip_from, call->sip_call_id);
+	sip_sendto(msg, &call->sip_peer, call->sip_peer_len);
+	talloc_free(msg);
+}
+
+/* "sip:1234@host" or "<sip:1234@host>;..." to the callref 1234 */
+static uint32_t sip_uri_callref(const char *uri)
+{
+	const char *user = strstr(uri, "sip:");
+
+	if (!user)
+		return 0;
+	return strtoul(user + 4, NULL, 10);
+}
+
+static char *sip_contact_uri(void *ctx, const char *contact)
+{
+	const char *start = strchr(contact, '<'), *end;
+
+	if (!start)
+		return talloc_strndup(ctx, contact, strcspn(contact, ";"));
+	end = strchr(++start, '>');
+	if (!end)
+		return NULL;
+	return talloc_strndup(ctx, start, end - start);
+}
+
+static void sip_rx_invite(struct sip_msg *msg, const struct sockaddr_storage *peer, socklen_t peer_len)
+{
+	const char *uri = msg->start_line + strlen("INVITE ");
+	const char *contact, *from, *to, *call_id;
+	struct load_call *call;
+	char *hdrs, tag[32];
+
+	call = call_find(sip_uri_callref(uri));
+	if (!call || call->state != LOAD_CALL_SETUP) {
+		hdrs = sip_rsp_hdrs(tall_load_ctx, msg, "load-unknown");
+		sip_respond("404 Not Found", hdrs, NULL, peer, peer_len);
+		talloc_free(hdrs);
+		return;
+	}
+
+	/* retransmission */
+	if (call->sip_rsp_hdrs) {
+		sip_respond("180 Ringing", call->sip_rsp_hdrs, NULL, peer, peer_len);
+		return;
+	}
+
+	contact = sip_hdr(msg, "Contact");
+	from = sip_hdr(msg, "From");
+	to = sip_hdr(msg, "To");
+	call_id = sip_hdr(msg, "Call-ID");
+	if (!contact || !from || !to || !call_id) {
+		hdrs = sip_rsp_hdrs(tall_load_ctx, msg, "load-invalid");
+		sip_respond("400 Bad Request", hdrs, NULL, peer, peer_len);
+		talloc_free(hdrs);
+		return;
+	}
+
+	snprintf(tag, sizeof(tag), "load-%u", call->callref);
+	memcpy(&call->sip_peer, peer, peer_len);
+	call->sip_peer_len = peer_len;
+	call->sip_rsp_hdrs = sip_rsp_hdrs(call, msg, tag);
+	call->sip_contact = sip_contact_uri(call, contact);
+	call->sip_from = talloc_strdup(call, from);
+	call->sip_to = talloc_asprintf(call, "%s;tag=%s", to, tag);
+	call->sip_call_id = talloc_strdup(call, call_id);
+
+	sip_respond("180 Ringing", call->sip_rsp_hdrs, NULL, peer, peer_len);
+	if (!g_load.answer_ms) {
+		sip_answer(call);
+		return;
+	}
+
+	osmo_timer_del(&call->timer);
+	osmo_timer_setup(&call->timer, answer_timeout, call);
+	osmo_timer_schedule(&call->timer, g_load.answer_ms / 1000, (g_load.answer_ms % 1000) * 1000);
+}
+
+static int sip_data(struct osmo_fd *fd, unsigned int what)
+{
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	struct sip_msg msg;
+	char buf[8192];
+	char *hdrs;
+	int rc;
+
+	rc = recvfrom(fd->fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *) &peer, &peer_len);
+	if (rc <= 0)
+		return 0;
+	buf[rc] = '\0';
+
+	if (!sip_parse(buf, &msg)) {
+		fprintf(stderr, "Failed to parse SIP message\n");
+		return 0;
+	}
+
+	/* responses to our BYE */
+	if (strncmp(msg.start_line, "SIP/2.0 ", 8) == 0)
+		return 0;
+
+	if (strncmp(msg.start_line, "INVITE ", 7) == 0)
+		sip_rx_invite(&msg, &peer, peer_len);
+	else if (strncmp(msg.start_line, "ACK ", 4) == 0)
+		return 0;
+	else {
+		/* BYE, CANCEL, OPTIONS, INFO: accept */
+		hdrs = sip_rsp_hdrs(tall_load_ctx, &msg, "load");
+		sip_respond("200 OK", hdrs, NULL, &peer, peer_len);
+		talloc_free(hdrs);
+	}
+	return 0;
+}
+
+/*
+ * Call generator
+ */
+static void interval_report(double now)
+{
+	double secs = (now - g_load.interval_start) / 1e3;
+	char label[16];
+	bool holds;
+
+	snprintf(label, sizeof(label), "%7.1fs", (now - g_load.start) / 1e3);
+	stats_print(label, &g_load.interval_stats, secs);
+
+	holds = stats_holds(&g_load.interval_stats);
+	if (holds && g_load.interval_stats.ok / secs > g_load.max_sustained)
+		g_load.max_sustained = g_load.interval_stats.ok / secs;
+
+	if (g_load.generating && g_load.ramp_step > 0) {
+		if (!holds) {
+			printf("rate %.1f does not hold, stopping the ramp\n", g_load.rate);
+			g_load.generating = false;
+		} else {
+			g_load.rate += g_load.ramp_step;
+			g_load.phase_start = now;
+			g_load.phase_sent = 0;
+			printf("ramping up to %.1f calls/s\n", g_load.rate);
+		}
+	}
+
+	g_load.interval_stats.attempts = 0;
+	g_load.interval_stats.ok = 0;
+	g_load.interval_stats.failed = 0;
+	g_load.interval_stats.latency_len = 0;
+	g_load.interval_start = now;
+}
+
+static void generator_tick(void *data)
+{
+	double now = now_ms();
+	unsigned long due;
+
+	if (g_load.generating) {
+		due = (now - g_load.phase_start) / 1e3 * g_load.rate;
+		while (g_load.phase_sent < due && g_load.active < g_load.max_calls) {
+			call_start();
+			g_load.phase_sent += 1;
+		}
+		/* do not build up a backlog while at the concurrency limit */
+		if (g_load.phase_sent < due)
+			g_load.phase_sent = due;
+		if (now - g_load.start >= g_load.duration * 1e3)
+			g_load.generating = false;
+	}
+
+	if (now - g_load.interval_start >= g_load.interval * 1e3)
+		interval_report(now);
+
+	if (!g_load.generating && !g_load.active) {
+		g_load.quit = true;
+		return;
+	}
+
+	osmo_timer_schedule(&g_load.tick, 0, LOAD_TICK_US);
+}
+
+static void generator_start(void)
+{
+	g_load.start = now_ms();
+	g_load.phase_start = g_load.start;
+	g_load.interval_start = g_load.start;
+	g_load.generating = true;
+	osmo_timer_setup(&g_load.tick, generator_tick, NULL);
+	osmo_timer_schedule(&g_load.tick, 0, LOAD_TICK_US);
+}
+
+static void print_help(void)
+{
+	printf("mncc_load: Load generator for osmo-sip-connector\n");
+	printf("  -h --help\t\t\tthis text\n");
+	printf("  -m --mncc-path PATH\t\tMNCC socket to listen on (%s)\n", g_load.mncc_path);
+	printf("  -a --sip-addr ADDR\t\tIPv4 address of the SIP UAS (%s)\n", g_load.sip_addr);
+	printf("  -p --sip-port PORT\t\tUDP port of the SIP UAS (%d)\n", g_load.sip_port);
+	printf("  -r --rate CAPS\t\tcall attempts per second (%.1f)\n", g_load.rate);
+	printf("  -s --ramp-step CAPS\t\tincrease the rate after every interval that holds\n");
+	printf("  -d --duration SECS\t\tstop originating calls after SECS (%u)\n", g_load.duration);
+	printf("  -i --interval SECS\t\treport and ramp interval (%u)\n", g_load.interval);
+	printf("  -H --hold-time MS\t\tduration of a connected call (%u)\n", g_load.hold_ms);
+	printf("  -A --answer-delay MS\t\tdelay between 180 Ringing and 200 OK (%u)\n", g_load.answer_ms);
+	printf("  -R --release SIDE\t\twho releases: msc, sip or mixed (%s)\n",
+	       get_value_string(load_release_names, g_load.release));
+	printf("  -c --max-calls N\t\tlimit of concurrent calls (%u)\n", g_load.max_calls);
+	printf("  -t --max-p99 MS\t\tsetup latency for an interval to hold (%.0f)\n", g_load.max_p99);
+	printf("  -f --max-failures PERCENT\tfailed setups for an interval to hold (%.1f)\n",
+	       g_load.max_fail_ratio * 100);
+	printf("\nConfigure osmo-sip-connector with 'mncc socket-path' set to the MNCC path\n"
+	       "and 'remote' of the SIP section pointing to the SIP address and port.\n");
+}
+
+static void handle_options(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0, c;
+		static const struct option long_options[] = {
+			{"help", 0, 0, 'h'},
+			{"mncc-path", 1, 0, 'm'},
+			{"sip-addr", 1, 0, 'a'},
+			{"sip-port", 1, 0, 'p'},
+			{"rate", 1, 0, 'r'},
+			{"ramp-step", 1, 0, 's'},
+			{"duration", 1, 0, 'd'},
+			{"interval", 1, 0, 'i'},
+			{"hold-time", 1, 0, 'H'},
+			{"answer-delay", 1, 0, 'A'},
+			{"release", 1, 0, 'R'},
+			{"max-calls", 1, 0, 'c'},
+			{"max-p99", 1, 0, 't'},
+			{"max-failures", 1, 0, 'f'},
+			{NULL, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "hm:a:p:r:s:d:i:H:A:R:c:t:f:",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 'm':
+			g_load.mncc_path = optarg;
+			break;
+		case 'a':
+			g_load.sip_addr = optarg;
+			break;
+		case 'p':
+			g_load.sip_port = atoi(optarg);
+			break;
+		case 'r':
+			g_load.rate = atof(optarg);
+			break;
+		case 's':
+			g_load.ramp_step = atof(optarg);
+			break;
+		case 'd':
+			g_load.duration = atoi(optarg);
+			break;
+		case 'i':
+			g_load.interval = atoi(optarg);
+			break;
+		case 'H':
+			g_load.hold_ms = atoi(optarg);
+			break;
+		case 'A':
+			g_load.answer_ms = atoi(optarg);
+			break;
+		case 'R':
+			if (get_string_value(load_release_names, optarg) < 0) {
+				fprintf(stderr, "Unknown release side '%s'\n", optarg);
+				exit(1);
+			}
+			g_load.release = get_string_value(load_release_names, optarg);
+			break;
+		case 'c':
+			g_load.max_calls = atoi(optarg);
+			break;
+		case 't':
+			g_load.max_p99 = atof(optarg);
+			break;
+		case 'f':
+			g_load.max_fail_ratio = atof(optarg) / 100;
+			break;
+		default:
+			print_help();
+			exit(1);
+		}
+	}
+
+	if (g_load.rate <= 0 || !g_load.interval || !g_load.setup_timeout) {
+		fprintf(stderr, "Rate and interval need to be positive\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double secs;
+	int rc;
+
+	tall_load_ctx = talloc_named_const(NULL, 0, "mncc_load");
+	handle_options(argc, argv);
+	hash_init(g_load.calls);
+	g_load.mncc.fd = -1;
+
+	unlink(g_load.mncc_path);
+	rc = osmo_sock_unix_init_ofd(&g_load.mncc_listen, SOCK_SEQPACKET, 0, g_load.mncc_path, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to listen on %s\n", g_load.mncc_path);
+		return EXIT_FAILURE;
+	}
+	g_load.mncc_listen.cb = mncc_accept;
+
+	g_load.sip.cb = sip_data;
+	rc = osmo_sock_init_ofd(&g_load.sip, AF_INET, SOCK_DGRAM, IPPROTO_UDP,
+				g_load.sip_addr, g_load.sip_port, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to bind SIP to %s:%d\n", g_load.sip_addr, g_load.sip_port);
+		return EXIT_FAILURE;
+	}
+
+	printf("Waiting for osmo-sip-connector on %s, SIP UAS on %s:%d\n",
+	       g_load.mncc_path, g_load.sip_addr, g_load.sip_port);
+
+	while (!g_load.quit)
+		osmo_select_main(0);
+
+	secs = (now_ms() - g_load.start) / 1e3;
+	printf("\n");
+	stats_print("total", &g_load.total, secs);
+	if (g_load.max_sustained > 0)
+		printf("max sustained CAPS: %.1f\n", g_load.max_sustained);
+	else
+		printf("max sustained CAPS: none of the intervals held\n");
+
+	unlink(g_load.mncc_path);
+	return g_load.total.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+/*
+ * Micro-benchmark for the SDP handling in src/sdp.c
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "sdp.h"
+#include "call.h"
+#include "logging.h"
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include <talloc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Count heap allocations of the process, including the ones made by talloc
+ * and sofia-sip inside their shared libraries. Symbols of the executable take
+ * precedence over the ones of libc, so forward to the glibc internals.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long n_allocs;
+
+void *malloc(size_t size)
+{
+	n_allocs += 1;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	n_allocs += 1;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	n_allocs += 1;
+	return __libc_realloc(ptr, size);
+}
+
+/* referenced by the objects of src/ */
+void *tall_mncc_ctx;
+
+static struct log_info_cat bench_categories[] = {
+	[DSIP] = {
+		.name		= "DSIP",
+		.enabled = 1, .loglevel = LOGL_NOTICE,
+	},
+	[DMNCC] = {
+		.name		= "DMNCC",
+		.enabled = 1, .loglevel = LOGL_NOTICE,
+	},
+	[DAPP] = {
+		.name		= "DAPP",
+		.enabled = 1, .loglevel = LOGL_NOTICE,
+	},
+	[DCALL] = {
+		.name		= "DCALL",
+		.enabled = 1, .loglevel = LOGL_NOTICE,
+	},
+};
+
+static const struct log_info bench_log_info = {
+	.cat = bench_categories,
+	.num_cat = ARRAY_SIZE(bench_categories),
+};
+
+struct bench_sdp {
+	const char *name;
+	const char *sdp;
+};
+
+static const struct bench_sdp corpus[] = {
+	{
+		/* what osmo-msc sends in MNCC_SETUP_IND */
+		.name = "amr-fmtp",
+		.sdp =
+			"v=0\r\n"
+			"o=OsmoMSC 0 0 IN IP4 10.23.42.7\r\n"
+			"s=GSM Call\r\n"
+			"c=IN IP4 10.23.42.7\r\n"
+			"t=0 0\r\n"
+			"m=audio 4002 RTP/AVP 112 3 111 110\r\n"
+			"a=rtpmap:112 AMR/8000\r\n"
+			"a=fmtp:112 octet-align=1;mode-set=0,2,4,7\r\n"
+			"a=rtpmap:3 GSM/8000\r\n"
+			"a=rtpmap:111 GSM-HR-08/8000\r\n"
+			"a=rtpmap:110 GSM-EFR/8000\r\n"
+			"a=ptime:20\r\n"
+			"a=sendrecv\r\n",
+	},
+	{
+		/* offer of a PBX, without direction attribute */
+		.name = "multi-codec",
+		.sdp =
+			"v=0\r\n"
+			"o=- 1234567890 1234567890 IN IP4 192.168.100.20\r\n"
+			"s=pbx\r\n"
+			"c=IN IP4 192.168.100.20\r\n"
+			"t=0 0\r\n"
+			"m=audio 16384 RTP/AVP 0 8 9 18 3 112 101\r\n"
+			"a=rtpmap:0 PCMU/8000\r\n"
+			"a=rtpmap:8 PCMA/8000\r\n"
+			"a=rtpmap:9 G722/8000\r\n"
+			"a=rtpmap:18 G729/8000\r\n"
+			"a=fmtp:18 annexb=no\r\n"
+			"a=rtpmap:3 GSM/8000\r\n"
+			"a=rtpmap:112 AMR/8000\r\n"
+			"a=fmtp:112 octet-align=1\r\n"
+			"a=rtpmap:101 telephone-event/8000\r\n"
+			"a=fmtp:101 0-16\r\n"
+			"a=ptime:20\r\n"
+			"a=maxptime:150\r\n",
+	},
+	{
+		.name = "ipv6",
+		.sdp =
+			"v=0\r\n"
+			"o=- 8127 8127 IN IP6 2001:db8:1234::42\r\n"
+			"s=-\r\n"
+			"c=IN IP6 2001:db8:1234::42\r\n"
+			"t=0 0\r\n"
+			"m=audio 30000 RTP/AVP 3 101\r\n"
+			"a=rtpmap:3 GSM/8000\r\n"
+			"a=rtpmap:101 telephone-event/8000\r\n"
+			"a=fmtp:101 0-15\r\n"
+			"a=sendonly\r\n",
+	},
+	{
+		/* close to the size of the MNCC sdp field, with a second media description */
+		.name = "oversized",
+		.sdp =
+			"v=0\r\n"
+			"o=FreeSWITCH 1700000000 1700000001 IN IP4 198.51.100.10\r\n"
+			"s=FreeSWITCH\r\n"
+			"c=IN IP4 198.51.100.10\r\n"
+			"t=0 0\r\n"
+			"a=msid-semantic: WMS freeswitch\r\n"
+			"m=audio 24680 RTP/AVP 112 96 3 0 8 9 18 101 13\r\n"
+			"a=rtpmap:112 AMR/8000\r\n"
+			"a=fmtp:112 octet-align=1;mode-set=0,2,4,7;mode-change-period=2\r\n"
+			"a=rtpmap:96 AMR-WB/16000\r\n"
+			"a=fmtp:96 octet-align=1\r\n"
+			"a=rtpmap:3 GSM/8000\r\n"
+			"a=rtpmap:0 PCMU/8000\r\n"
+			"a=rtpmap:8 PCMA/8000\r\n"
+			"a=rtpmap:9 G722/8000\r\n"
+			"a=rtpmap:18 G729/8000\r\n"
+			"a=fmtp:18 annexb=no\r\n"
+			"a=rtpmap:101 telephone-event/8000\r\n"
+			"a=fmtp:101 0-16\r\n"
+			"a=rtpmap:13 CN/8000\r\n"
+			"a=ptime:20\r\n"
+			"a=rtcp:24681 IN IP4 198.51.100.10\r\n"
+			"a=ssrc:2891236611 cname:Vx5SsVeUsMd7XaYm\r\n"
+			"a=ssrc:2891236611 msid:freeswitch a0\r\n"
+			"a=sendrecv\r\n"
+			"m=video 0 RTP/AVP 96 97\r\n"
+			"a=rtpmap:96 VP8/90000\r\n"
+			"a=rtpmap:97 H264/90000\r\n"
+			"a=fmtp:97 profile-level-id=42e01f;packetization-mode=1\r\n"
+			"a=rtcp-fb:96 nack\r\n"
+			"a=rtcp-fb:96 nack pli\r\n"
+			"a=rtcp-fb:96 ccm fir\r\n"
+			"a=rtcp-fb:97 nack\r\n"
+			"a=rtcp-fb:97 nack pli\r\n"
+			"a=inactive\r\n",
+	},
+};
+
+struct bench_ctx {
+	const struct bench_sdp *in;
+	sip_t sip;
+	sip_payload_t payload;
+	struct sdp_parsed parsed;
+	struct sip_call_leg *leg;
+	struct call_leg *other;
+};
+
+typedef void (*bench_op)(struct bench_ctx *ctx);
+
+static void op_parse(struct bench_ctx *ctx)
+{
+	struct sdp_parsed sdp;
+
+	sdp_parse_sip(&sdp, &ctx->sip);
+	sdp_parsed_free(&sdp);
+}
+
+static void op_screen(struct bench_ctx *ctx)
+{
+	sdp_screen_sdp(&ctx->parsed);
+}
+
+static void op_get_mode(struct bench_ctx *ctx)
+{
+	sdp_mode_t mode;
+
+	sdp_get_sdp_mode(&ctx->parsed, &mode);
+}
+
+static void op_extract(struct bench_ctx *ctx)
+{
+	sdp_extract_sdp(ctx->leg, &ctx->parsed, false);
+}
+
+static void op_create_file(struct bench_ctx *ctx)
+{
+	call_leg_flush_sdp_cache(ctx->other);
+	sdp_create_file(ctx->leg, ctx->other, sdp_recvonly);
+}
+
+static void op_create_file_cached(struct bench_ctx *ctx)
+{
+	sdp_create_file(ctx->leg, ctx->other, sdp_recvonly);
+}
+
+static const struct {
+	const char *name;
+	bench_op op;
+} ops[] = {
+	{ "parse",		op_parse },
+	{ "screen",		op_screen },
+	{ "get_mode",		op_get_mode },
+	{ "extract",		op_extract },
+	{ "create_file",	op_create_file },
+	{ "create_file/hit",	op_create_file_cached },
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_run(struct bench_ctx *ctx, const char *name, bench_op op, unsigned long iterations)
+{
+	unsigned long i, allocs;
+	double start, elapsed;
+
+	/* warm up the caches and the SDP cache of the leg */
+	op(ctx);
+
+	allocs = n_allocs;
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+		op(ctx);
+	elapsed = now_ns() - start;
+	allocs = n_allocs - allocs;
+
+	printf("%-12s %-16s %10.1f ns/op %8.2f allocs/op\n", ctx->in->name, name,
+	       elapsed / iterations, (double) allocs / iterations);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = 20000;
+	int i, j;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+
+	tall_mncc_ctx = talloc_named_const(NULL, 0, "sdp_bench");
+	osmo_init_logging2(tall_mncc_ctx, &bench_log_info);
+	log_set_log_level(osmo_stderr_target, LOGL_FATAL);
+
+	for (i = 0; i < ARRAY_SIZE(corpus); ++i) {
+		struct bench_ctx ctx = { .in = &corpus[i] };
+
+		ctx.payload.pl_data = corpus[i].sdp;
+		ctx.payload.pl_len = strlen(corpus[i].sdp);
+		ctx.sip.sip_payload = &ctx.payload;
+
+		ctx.leg = talloc_zero(tall_mncc_ctx, struct sip_call_leg);
+		ctx.leg->base.type = CALL_TYPE_SIP;
+		ctx.leg->wanted_codec = "GSM";
+		ctx.other = talloc_zero(tall_mncc_ctx, struct call_leg);
+		ctx.other->type = CALL_TYPE_MNCC;
+		ctx.other->rx_sdp = talloc_strdup(ctx.other, corpus[i].sdp);
+		ctx.other->rx_sdp_len = strlen(corpus[i].sdp);
+
+		if (!sdp_parse_sip(&ctx.parsed, &ctx.sip)) {
+			fprintf(stderr, "%s: failed to parse SDP\n", corpus[i].name);
+			return EXIT_FAILURE;
+		}
+
+		for (j = 0; j < ARRAY_SIZE(ops); ++j)
+			bench_run(&ctx, ops[j].name, ops[j].op, iterations);
+
+		sdp_parsed_free(&ctx.parsed);
+		talloc_free(ctx.other);
+		talloc_free(ctx.leg);
+	}
+
+	talloc_free(tall_mncc_ctx);
+	return EXIT_SUCCESS;
+}